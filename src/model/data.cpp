@@ -1,10 +1,21 @@
 #include "data.h"
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <deque>
+#include <functional>
+#include <list>
 #include <map>
+#include <memory>
+#include <set>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <sqlite3.h>
 
 #include "data_init.h"
+#include "snapshot.h"
 #include "../util/db_support.h"
 #include "../util/error.h"
 #include "../util/hash.h"
@@ -23,6 +34,989 @@ static double now () {
     return duration<double>(system_clock::now().time_since_epoch()).count();
 }
 
+ // New ids are picked here instead of by SQLite, so that INSERTs can be queued
+ // for the writer thread.  These are reloaded after a rollback.
+static bool ids_loaded = false;
+static int64 last_tab_id;
+static int64 last_window_id;
+
+static State<int64>::Ment<> get_max_tab_id {"SELECT coalesce(max(id), 0) FROM tabs"};
+static State<int64>::Ment<> get_max_window_id {"SELECT coalesce(max(id), 0) FROM windows"};
+static void load_ids () {
+    if (ids_loaded) return;
+    last_tab_id = get_max_tab_id.run_single();
+    last_window_id = get_max_window_id.run_single();
+    ids_loaded = true;
+}
+static int64 new_tab_id () { load_ids(); return ++last_tab_id; }
+static int64 new_window_id () { load_ids(); return ++last_window_id; }
+
+///// Tab index
+
+ // The tree structure of the tabs table is kept in memory, so that walking the
+ // tree doesn't have to go through SQLite.  It's loaded once by init_db, and
+ // kept in sync by the functions that change parent, position, or closed_at.
+struct TabChildren {
+    map<Bifractor, int64> all;
+    map<Bifractor, int64> unclosed;
+};
+static unordered_map<int64, TabChildren> children_by_parent;
+
+ // Positions too long to be stored inline are kept in an arena instead of
+ // each having its own allocation.  Removing one doesn't free its space, so
+ // the index is copied into a fresh arena when the arena gets too big.
+static BifractorArena index_arena;
+static constexpr size_t min_index_arena_limit = 1 << 20;
+static size_t index_arena_limit = min_index_arena_limit;
+
+static void index_compact () {
+    BifractorArena fresh;
+    for (auto& [parent, children] : children_by_parent) {
+        for (auto m : {&children.all, &children.unclosed}) {
+            map<Bifractor, int64> copied;
+            for (auto& [position, id] : *m) {
+                copied.emplace_hint(copied.end(), fresh.copy(position), id);
+            }
+            *m = move(copied);
+        }
+    }
+    index_arena = move(fresh);
+    index_arena_limit = max(index_arena.bytes_used() * 2, min_index_arena_limit);
+}
+
+static void index_add (int64 id, int64 parent, const Bifractor& position, bool closed) {
+    auto& children = children_by_parent[parent];
+    children.all.emplace(index_arena.copy(position), id);
+    if (!closed) children.unclosed.emplace(index_arena.copy(position), id);
+    if (index_arena.bytes_used() > index_arena_limit) index_compact();
+}
+
+static void index_remove (int64 parent, const Bifractor& position) {
+    auto iter = children_by_parent.find(parent);
+    AA(iter != children_by_parent.end());
+    iter->second.all.erase(position);
+    iter->second.unclosed.erase(position);
+    if (iter->second.all.empty()) {
+        children_by_parent.erase(iter);
+    }
+}
+
+static void index_set_closed (int64 parent, const Bifractor& position, bool closed) {
+    auto iter = children_by_parent.find(parent);
+    AA(iter != children_by_parent.end());
+    auto& children = iter->second;
+    if (closed) children.unclosed.erase(position);
+    else {
+        auto tab = children.all.find(position);
+        AA(tab != children.all.end());
+        children.unclosed.emplace(index_arena.copy(position), tab->second);
+    }
+}
+
+ // For looking things up, since operator[] would add an empty entry
+static const TabChildren& index_children (int64 parent) {
+    static const TabChildren none;
+    auto iter = children_by_parent.find(parent);
+    return iter == children_by_parent.end() ? none : iter->second;
+}
+
+static void recency_clear ();
+static void rekey_if_long (int64 parent, span<const Bifractor> positions);
+
+static State<int64, int64, Bifractor, bool>::Ment<> get_tab_index {R"(
+SELECT id, parent, position, closed_at IS NOT NULL FROM tabs
+)"};
+void load_tab_index () {
+    LOG("load_tab_index");
+    children_by_parent.clear();
+    index_arena = BifractorArena();
+    index_arena_limit = min_index_arena_limit;
+    recency_clear();
+    for (auto [id, parent, position, closed] : get_tab_index.iterate()) {
+        index_add(id, parent, position, closed);
+    }
+}
+
+///// Recency
+
+ // The most recently visited unclosed tabs, most recent first.  This is always
+ // the start of the list that get_last_visited_tabs would get from the
+ // database, but it may be cut off anywhere.  It starts empty and is filled in
+ // by get_last_visited_tabs when it isn't long enough.
+static list<pair<double, int64>> recent_tabs;
+static unordered_map<int64, list<pair<double, int64>>::iterator> recent_tabs_by_id;
+ // Whether recent_tabs has every visited unclosed tab, because the database
+ // had fewer than were asked for.
+static bool recent_tabs_complete = false;
+
+static void recency_clear () {
+    recent_tabs.clear();
+    recent_tabs_by_id.clear();
+    recent_tabs_complete = false;
+}
+
+static void recency_remove (int64 id) {
+    auto iter = recent_tabs_by_id.find(id);
+    if (iter == recent_tabs_by_id.end()) return;
+    recent_tabs.erase(iter->second);
+    recent_tabs_by_id.erase(iter);
+}
+
+static void recency_visit (int64 id, double visited_at) {
+    recency_remove(id);
+    recent_tabs.emplace_front(visited_at, id);
+    recent_tabs_by_id.emplace(id, recent_tabs.begin());
+}
+
+ // For an unclosed tab.  If it belongs past the end of the list, leave it out,
+ // unless the list is supposed to be complete.
+static void recency_unclose (int64 id, double visited_at) {
+    if (!visited_at) return;
+    if (!recent_tabs_complete) {
+        if (recent_tabs.empty()) return;
+        if (visited_at <= recent_tabs.back().first) return;
+    }
+    auto pos = recent_tabs.end();
+    while (pos != recent_tabs.begin() && prev(pos)->first < visited_at) --pos;
+    recent_tabs_by_id.emplace(id, recent_tabs.emplace(pos, visited_at, id));
+}
+
+///// Aggregates
+
+ // Totals over each tab's unclosed descendants, leaving out any that are under
+ // a closed tab (the tab itself may be closed).  To add one, add a column to
+ // the tabs table, a member to TabData, a TabField bit after the others, and
+ // an entry here.  counts may only look at TabData's numeric fields.
+struct TabAggregate {
+    const char* column;
+    int64 TabData::* total;
+    uint32 field;
+    bool (* counts )(const TabData&);
+};
+static constexpr TabAggregate aggregates [] = {
+    {"child_count", &TabData::child_count, TAB_CHILD_COUNT,
+        [](const TabData&){ return true; }},
+    {"unvisited_count", &TabData::unvisited_count, TAB_UNVISITED_COUNT,
+        [](const TabData& t){ return !t.visited_at; }},
+    {"starred_count", &TabData::starred_count, TAB_STARRED_COUNT,
+        [](const TabData& t){ return !!t.starred_at; }},
+};
+static constexpr size_t n_aggregates = std::size(aggregates);
+static constexpr uint32 aggregate_fields = []{
+    uint32 r = 0;
+    for (auto& agg : aggregates) r |= agg.field;
+    return r;
+}();
+static_assert([]{
+    for (size_t i = 0; i < n_aggregates; i++) {
+        if (aggregates[i].field != uint32(TAB_CHILD_COUNT) << i) return false;
+    }
+    return true;
+}(), "Aggregate TabFields must be in order after TAB_CHILD_COUNT");
+
+struct AggregateDelta {
+    int64 diffs [n_aggregates] = {};
+
+    explicit operator bool () const {
+        for (int64 d : diffs) if (d) return true;
+        return false;
+    }
+    AggregateDelta& operator += (const AggregateDelta& o) {
+        for (size_t i = 0; i < n_aggregates; i++) diffs[i] += o.diffs[i];
+        return *this;
+    }
+    AggregateDelta operator - () const {
+        AggregateDelta r;
+        for (size_t i = 0; i < n_aggregates; i++) r.diffs[i] = -diffs[i];
+        return r;
+    }
+    AggregateDelta operator - (const AggregateDelta& o) const {
+        AggregateDelta r = *this;
+        return r += -o;
+    }
+};
+
+ // What an unclosed tab adds to each of its ancestors' totals
+static AggregateDelta contribution (const TabData& t) {
+    AggregateDelta r;
+    for (size_t i = 0; i < n_aggregates; i++) {
+        r.diffs[i] = aggregates[i].counts(t) + t.*aggregates[i].total;
+    }
+    return r;
+}
+
+ // "a = ?, b = ?, ..." or "a = 0, b = 0, ..."
+static String aggregate_columns (Str value) {
+    String r;
+    for (auto& agg : aggregates) {
+        if (!r.empty()) r += ", "sv;
+        r += agg.column;
+        r += " = "sv;
+        r += value;
+    }
+    return r;
+}
+
+///// Writer thread
+
+ // While the writer thread is running, statements given to run_write are
+ // queued for it instead of being run here, and it runs them on a connection
+ // of its own, writer_db.  Queries stay on db, which in WAL mode can read
+ // while writer_db writes, so they only see what writer_db has committed.
+ // When that isn't enough (see route_statement), the statement waits for the
+ // queue to empty and runs on writer_db, in the same transaction as the
+ // queued writes, so it sees the same database it would have without the
+ // writer thread.  Anything that isn't a query does the same.
+
+struct WriteCommand {
+     // The model thread's copy of the statement.  The writer thread prepares
+     // its own from the same SQL, so they don't fight over bindings.  nullptr
+     // tells the writer thread to stop.
+    Statement* statement = nullptr;
+    function<void(Statement&)> bind;
+     // Marks the SAVEPOINT and RELEASE around each logical transaction in a
+     // group (see group commit), and the COMMIT or ROLLBACK that ends the
+     // SQLite transaction, so the writer thread knows how far to skip after an
+     // error.
+    enum Boundary : uint8 {
+        NO_BOUNDARY,
+        BEGINS_LOGICAL,
+        ENDS_LOGICAL,
+        ENDS_TRANSACTION
+    };
+    Boundary boundary = NO_BOUNDARY;
+    shared_ptr<promise<void>> committed;
+    atomic<WriteCommand*> next = nullptr;
+};
+
+ // A lock-free queue with one producer and one consumer.  The model thread
+ // only touches queue_tail and the writer thread only touches queue_head (which
+ // is the last command taken).  They only meet at next.
+static WriteCommand* queue_head = nullptr;
+static WriteCommand* queue_tail = nullptr;
+static atomic<uint64> commands_pushed = 0;
+static atomic<uint64> commands_done = 0;
+static thread writer;
+static thread_local bool on_writer_thread = false;
+static sqlite3* writer_db = nullptr;
+ // commands_done as of the last time writer_db was outside a transaction, so
+ // that db can see what those commands wrote.
+static atomic<uint64> commands_visible = 0;
+ // commands_pushed as of the last queued write.  Only the model thread uses
+ // these.
+static uint64 last_write_queued = 0;
+ // The same, but only counting writes to rows that might not be in the cache
+ // (see cache_covers).
+static uint64 last_uncached_write = 0;
+ // Set by the writer thread before it finishes the failing command, so it's
+ // safe to read once commands_done has caught up.
+static exception_ptr writer_error;
+ // Set along with writer_error, so that queries that wouldn't otherwise wait
+ // for the writer thread wait for it and throw the error.
+static atomic<bool> writer_failed = false;
+static shared_future<void> last_commit;
+ // The cache still has what the failed write was writing, so it's reloaded
+ // when the error is thrown (see forget_failed_writes).
+static void forget_failed_writes ();
+
+static void push_write (unique_ptr<WriteCommand> command) {
+    WriteCommand* c = command.release();
+    queue_tail->next.store(c, memory_order_release);
+    queue_tail = c;
+    commands_pushed.fetch_add(1, memory_order_release);
+    commands_pushed.notify_one();
+}
+
+static void writer_main () {
+    on_writer_thread = true;
+     // These belong to this thread, so they're transient.
+    unordered_map<Statement*, unique_ptr<Statement>> statements;
+     // Whether a logical transaction's savepoint is open
+    bool in_logical = false;
+     // After an error, as little as possible is rolled back, and commands are
+     // skipped until the end of what was.  That's the logical transaction the
+     // error was in, if there is one, so the other ones in the group still get
+     // committed.  Otherwise it's the whole SQLite transaction.
+    WriteCommand::Boundary skip_to = WriteCommand::NO_BOUNDARY;
+     // The first error in this SQLite transaction, for committed
+    exception_ptr failed;
+    for (;;) {
+        WriteCommand* c;
+        for (;;) {
+            uint64 seen = commands_pushed.load(memory_order_acquire);
+            c = queue_head->next.load(memory_order_acquire);
+            if (c) break;
+            commands_pushed.wait(seen);
+        }
+        delete queue_head;
+        queue_head = c;
+        if (!c->statement) {
+            commands_done.fetch_add(1, memory_order_release);
+            commands_done.notify_all();
+            break;
+        }
+        bool run = true;
+        if (skip_to) {
+            run = false;
+            if (c->boundary == skip_to) {
+                skip_to = WriteCommand::NO_BOUNDARY;
+                 // The savepoint was rolled back to but it's still there.
+                run = c->boundary == WriteCommand::ENDS_LOGICAL;
+            }
+        }
+        if (run) {
+            try {
+                auto& st = statements[c->statement];
+                if (!st) {
+                    sqlite3_stmt* h;
+                    AS(writer_db, sqlite3_prepare_v3(
+                        writer_db, c->statement->sql.c_str(), -1, 0, &h, nullptr
+                    ));
+                    st = make_unique<Statement>(h);
+                }
+                if (c->bind) c->bind(*st);
+                st->step();
+                AA(st->done());
+                st->reset();
+                if (c->boundary == WriteCommand::BEGINS_LOGICAL) in_logical = true;
+                else if (c->boundary == WriteCommand::ENDS_LOGICAL) in_logical = false;
+            }
+            catch (...) {
+                auto e = current_exception();
+                if (!failed) failed = e;
+                if (!writer_error) {
+                    writer_error = e;
+                    writer_failed.store(true, memory_order_release);
+                }
+                for (auto& [_, st] : statements) st->abandon();
+                 // SQLite may have rolled back the whole transaction already
+                if (in_logical && c->boundary != WriteCommand::ENDS_LOGICAL
+                 && !sqlite3_get_autocommit(writer_db)
+                 && sqlite3_exec(writer_db, "ROLLBACK TO logical", nullptr, nullptr, nullptr) == SQLITE_OK
+                ) {
+                    skip_to = WriteCommand::ENDS_LOGICAL;
+                }
+                else {
+                    if (!sqlite3_get_autocommit(writer_db)) {
+                        sqlite3_exec(writer_db, "ROLLBACK", nullptr, nullptr, nullptr);
+                    }
+                    in_logical = false;
+                    if (c->boundary != WriteCommand::ENDS_TRANSACTION) {
+                        skip_to = WriteCommand::ENDS_TRANSACTION;
+                    }
+                }
+            }
+        }
+        if (c->boundary == WriteCommand::ENDS_TRANSACTION) {
+            if (c->committed) {
+                if (failed) c->committed->set_exception(failed);
+                else c->committed->set_value();
+            }
+            failed = nullptr;
+        }
+        uint64 done = commands_done.load(memory_order_relaxed) + 1;
+        if (sqlite3_get_autocommit(writer_db)) {
+            commands_visible.store(done, memory_order_release);
+        }
+        commands_done.store(done, memory_order_release);
+        commands_done.notify_all();
+    }
+}
+
+static void wait_for_writer () {
+    if (on_writer_thread) return;
+    uint64 pushed = commands_pushed.load(memory_order_relaxed);
+    for (;;) {
+        uint64 done = commands_done.load(memory_order_acquire);
+        if (done == pushed) break;
+        commands_done.wait(done);
+    }
+     // Don't throw while rolling back; the rollback takes care of it.
+    if (writer_error && !uncaught_exceptions()) {
+        auto e = writer_error;
+        writer_error = nullptr;
+        writer_failed = false;
+        forget_failed_writes();
+        rethrow_exception(e);
+    }
+}
+
+ // Queries that the cache corrects, so they can read what's committed even
+ // with writes queued, as long as those writes are to cached rows.  Defined
+ // after the statements it lists.
+static bool cache_covers (Statement&);
+
+ // The before_statement hook while the writer thread is running.  A query
+ // stays on db if db can already see every queued write it might depend on.
+ // Otherwise the statement waits for the queue to empty, then runs on
+ // writer_db, unless it's a query and writer_db has nothing uncommitted.
+static sqlite3* route_statement (Statement& st) {
+    if (on_writer_thread) return nullptr;
+    sqlite3_stmt* h = st.get();
+     // Transaction control statements count as read-only, but have no columns.
+    bool query = sqlite3_stmt_readonly(h) && sqlite3_column_count(h);
+    if (query && !writer_failed.load(memory_order_acquire)) {
+        uint64 visible = commands_visible.load(memory_order_acquire);
+        if (last_uncached_write <= visible
+         && (last_write_queued <= visible || cache_covers(st))
+        ) return nullptr;
+    }
+    wait_for_writer();
+    if (sqlite3_get_autocommit(writer_db)) {
+        last_write_queued = last_uncached_write = 0;
+        if (query) return nullptr;
+    }
+     // Anything this writes won't be visible to db until writer_db commits,
+     // which will be after the next command at the earliest.
+    if (!query) {
+        last_write_queued = last_uncached_write = commands_pushed + 1;
+    }
+    return writer_db;
+}
+
+ // Counts statements that write, run or queued by run_write, so a Transaction
+ // can tell whether it wrote anything.
+static uint64 writes_run = 0;
+ // BEGIN, COMMIT and the like count as read-only
+static bool count_write (Statement& st) {
+    bool writes = !sqlite3_stmt_readonly(st.get());
+    if (writes) writes_run += 1;
+    return writes;
+}
+
+ // Runs a statement that doesn't return anything, or queues it for the
+ // writer thread.  bind is given the statement to bind parameters to, which
+ // may be a different one with the same SQL.  st must not be transient.
+static void run_write (
+    Statement& st, function<void(Statement&)> bind,
+    WriteCommand::Boundary boundary = WriteCommand::NO_BOUNDARY
+) {
+    bool writes = count_write(st);
+    if (writer.joinable()) {
+        auto c = make_unique<WriteCommand>();
+        c->statement = &st;
+        c->bind = move(bind);
+        c->boundary = boundary;
+        push_write(move(c));
+        if (writes) last_write_queued = commands_pushed;
+    }
+    else {
+        if (bind) bind(st);
+        st.step();
+        AA(st.done());
+        st.reset();
+    }
+}
+
+template <class T> struct Owned { using type = T; };
+template <> struct Owned<Str> { using type = String; };
+
+template <class... Params>
+static void run_write (State<>::Ment<Params...>& st, const Params&... params) {
+    if (!writer.joinable()) {
+        count_write(st);
+        st.run_void(params...);
+        return;
+    }
+     // Strings are bound without copying them, so the queued command has to
+     // own them.
+    run_write(st, [...params = typename Owned<Params>::type(params)](Statement& s){
+        int i = 1;
+        (s.bind_param(i++, params), ...);
+    });
+}
+
+template <class... Params>
+static void run_write_batch (
+    State<>::Ment<Params...>& st, type_identity_t<span<const tuple<Params...>>> rows
+) {
+    if (!writer.joinable()) {
+        count_write(st);
+        st.run_batch(rows);
+        return;
+    }
+    for (auto& row : rows) {
+        apply([&](const Params&... params){ run_write(st, params...); }, row);
+    }
+}
+
+void start_writer_thread () {
+    AA(!writer.joinable());
+     // db can't be in the middle of a transaction that writer_db can't see
+    AA(sqlite3_get_autocommit(db));
+    writer_db = open_db_connection();
+    queue_head = queue_tail = new WriteCommand;
+    commands_pushed = 0;
+    commands_done = 0;
+    commands_visible = 0;
+    last_write_queued = 0;
+    last_uncached_write = 0;
+    before_statement = &route_statement;
+    writer = thread(&writer_main);
+     // Destroying a thread that hasn't been joined ends the program, so if
+     // nobody calls stop_writer_thread, do it at exit.  This runs before the
+     // statements it uses are destroyed, since they were constructed before
+     // it was registered.
+    static bool stop_at_exit = false;
+    if (!stop_at_exit) {
+        stop_at_exit = true;
+        atexit([]{
+            try { stop_writer_thread(); }
+            catch (std::exception&) { }
+        });
+    }
+}
+
+void stop_writer_thread () {
+    if (!writer.joinable()) return;
+    push_write(make_unique<WriteCommand>());
+    writer.join();
+    delete queue_head;
+    queue_head = queue_tail = nullptr;
+    before_statement = nullptr;
+    forget_connection(writer_db);
+     // Transient statements may still have copies on it
+    AS(writer_db, sqlite3_close_v2(writer_db));
+    writer_db = nullptr;
+    last_commit = {};
+    if (writer_error) {
+        auto e = writer_error;
+        writer_error = nullptr;
+        writer_failed = false;
+        forget_failed_writes();
+        rethrow_exception(e);
+    }
+}
+
+shared_future<void> committed_to_disk () {
+    flush_group_commit();
+    if (!last_commit.valid()) {
+        promise<void> done;
+        done.set_value();
+        return done.get_future().share();
+    }
+    return last_commit;
+}
+
+///// Deferred writes
+
+static vector<int64> dirty_tabs;
+static vector<int64> dirty_windows;
+
+static uint32 relaxed_tab_fields = TAB_VISITED_AT | TAB_TITLE | TAB_FAVICON;
+static uint32 relaxed_window_fields = WINDOW_FOCUSED_TAB;
+static double relaxed_max_delay = 5;
+ // Whether any non-relaxed change is waiting to be written
+static bool strict_changes = false;
+ // When the oldest relaxed change that hasn't been written was made
+static double relaxed_since = 0;
+
+ // Relaxed changes that were waiting when the current transaction started
+ // belong to transactions that already committed, so if this one rolls back,
+ // they're put back instead of being lost with it.  Instead of copying every
+ // dirty row when the transaction starts, a row is copied the first time the
+ // transaction is about to change or write it (see tab_changing), which for
+ // most rows is never.
+static vector<pair<int64, TabData>> saved_dirty_tabs;
+static vector<pair<int64, WindowData>> saved_dirty_windows;
+ // Rows the transaction has changed or written, whether or not they needed
+ // saving
+static unordered_set<int64> touched_tabs;
+static unordered_set<int64> touched_windows;
+static double saved_relaxed_since = 0;
+ // Changes put back by a rollback, for rows that haven't been loaded since.
+ // get_tab_data and get_window_data apply them over the row they read.
+static unordered_map<int64, TabData> restored_tabs;
+static unordered_map<int64, WindowData> restored_windows;
+
+ // At the start and end of each top-level transaction
+static void reset_undo_log () {
+    saved_dirty_tabs.clear();
+    saved_dirty_windows.clear();
+    touched_tabs.clear();
+    touched_windows.clear();
+    saved_relaxed_since = relaxed_since;
+}
+
+ // Call before changing a deferred field of a cached row, or writing it
+static void tab_changing (int64 id, const TabData* data) {
+    if (!touched_tabs.emplace(id).second) return;
+    if (data->dirty) saved_dirty_tabs.emplace_back(id, *data);
+}
+static void window_changing (int64 id, const WindowData* data) {
+    if (!touched_windows.emplace(id).second) return;
+    if (data->dirty) saved_dirty_windows.emplace_back(id, *data);
+}
+
+ // Only the deferred fields are put back.  The rest come from the database,
+ // since the transaction may have changed them too.
+static void apply_restored (int64 id, TabData& data) {
+    auto iter = restored_tabs.find(id);
+    if (iter == restored_tabs.end()) return;
+    auto& from = iter->second;
+    uint32 fields = from.dirty;
+    if (fields & TAB_URL) data.url = move(from.url);
+    if (fields & TAB_TITLE) data.title = move(from.title);
+    if (fields & TAB_FAVICON) data.favicon = move(from.favicon);
+    if (fields & TAB_VISITED_AT) data.visited_at = from.visited_at;
+    if (fields & TAB_STARRED_AT) data.starred_at = from.starred_at;
+    if (fields & TAB_CLOSED_AT) data.closed_at = from.closed_at;
+    for (auto& agg : aggregates) {
+        if (fields & agg.field) data.*agg.total = from.*agg.total;
+    }
+    data.dirty = fields;
+    restored_tabs.erase(iter);
+}
+static void apply_restored (int64 id, WindowData& data) {
+    auto iter = restored_windows.find(id);
+    if (iter == restored_windows.end()) return;
+    auto& from = iter->second;
+    uint32 fields = from.dirty;
+    if (fields & WINDOW_ROOT_TAB) data.root_tab = from.root_tab;
+    if (fields & WINDOW_FOCUSED_TAB) data.focused_tab = from.focused_tab;
+    if (fields & WINDOW_CLOSED_AT) data.closed_at = from.closed_at;
+    data.dirty = fields;
+    restored_windows.erase(iter);
+}
+
+ // When the database rolls back, before the cache is cleared.  Dirty rows the
+ // transaction didn't touch still have what they had when it started (unless
+ // they're waiting in restored_* from an earlier rollback), and the ones it
+ // touched were saved, unless they weren't dirty then.
+template <class Data>
+static void restore_dirty (
+    vector<int64>& dirty, map<int64, Data>& cache,
+    const unordered_set<int64>& touched, vector<pair<int64, Data>>& saved,
+    unordered_map<int64, Data>& restored
+) {
+    vector<int64> still_dirty;
+    for (int64 id : dirty) {
+        if (touched.count(id)) continue;
+        still_dirty.push_back(id);
+        auto iter = cache.find(id);
+        if (iter != cache.end()) restored.insert_or_assign(id, move(iter->second));
+    }
+    for (auto& [id, data] : saved) {
+        still_dirty.push_back(id);
+        restored.insert_or_assign(id, move(data));
+    }
+    dirty = move(still_dirty);
+}
+
+static void note_change (uint32 fields, uint32 relaxed_fields) {
+    if (fields & ~relaxed_fields) strict_changes = true;
+    else if (!relaxed_since) relaxed_since = now();
+}
+
+static void tab_changed (int64 id, TabData* data, uint32 fields) {
+    if (!data->dirty) dirty_tabs.push_back(id);
+    data->dirty |= fields;
+    note_change(fields, relaxed_tab_fields);
+    tab_updated(id, fields);
+}
+
+static void window_changed (int64 id, WindowData* data, uint32 fields) {
+    if (!data->dirty) dirty_windows.push_back(id);
+    data->dirty |= fields;
+    note_change(fields, relaxed_window_fields);
+    window_updated(id, fields);
+}
+
+ // An UPDATE statement for each combination of columns that can be written,
+ // indexed by fields.  These are made when the module initializes, so
+ // prepare_statements prepares them along with everything else.  grouped
+ // columns are always written together, which leaves out combinations that
+ // have only some of them.
+static vector<unique_ptr<Statement>> make_flush_statements (
+    Str table, span<const String> columns, uint32 grouped = 0
+) {
+    vector<unique_ptr<Statement>> r (size_t(1) << columns.size());
+    for (uint32 fields = 1; fields < r.size(); fields++) {
+        if ((fields & grouped) && (fields & grouped) != grouped) continue;
+        String sql = "UPDATE "sv + table + " SET "sv;
+        bool first = true;
+        for (size_t i = 0; i < columns.size(); i++) {
+            if (fields & (1 << i)) {
+                if (!first) sql += ", "sv;
+                sql += columns[i];
+                first = false;
+            }
+        }
+        sql += " WHERE id = ?"sv;
+        r[fields] = make_unique<Statement>(sql.c_str());
+    }
+    return r;
+}
+
+static const vector<String> tab_flush_columns = []{
+    vector<String> r {
+        "url_hash = ?, url = ?",
+        "title = ?",
+        "favicon = ?",
+        "visited_at = ?",
+        "starred_at = ?",
+        "closed_at = ?",
+    };
+    for (auto& agg : aggregates) r.push_back(agg.column + " = ?"s);
+    return r;
+}();
+static constexpr uint32 tab_flush_fields = (uint32(TAB_CHILD_COUNT) << n_aggregates) - 1;
+ // The aggregates aren't indexed, so writing all of them when any changed
+ // costs next to nothing, and it makes 127 statements instead of 511.
+static vector<unique_ptr<Statement>> tab_flush_statements =
+    make_flush_statements("tabs", tab_flush_columns, aggregate_fields);
+
+static const String window_flush_columns [] = {
+    "root_tab = ?",
+    "focused_tab = ?",
+    "closed_at = ?",
+};
+static constexpr uint32 window_flush_fields =
+    WINDOW_ROOT_TAB | WINDOW_FOCUSED_TAB | WINDOW_CLOSED_AT;
+static vector<unique_ptr<Statement>> window_flush_statements =
+    make_flush_statements("windows", window_flush_columns);
+
+static uint64 tabs_written = 0;
+static uint64 windows_written = 0;
+
+ // Writes all deferred changes.  Call this before running any statement that
+ // reads a deferred field.
+static void flush_changes () {
+    for (int64 id : dirty_tabs) {
+        auto data = get_tab_data(id);
+        tab_changing(id, data);
+        uint32 fields = data->dirty & tab_flush_fields;
+        data->dirty = 0;
+        if (data->deleted || !fields) continue;
+        if (fields & aggregate_fields) fields |= aggregate_fields;
+        auto& st = *tab_flush_statements[fields];
+        auto bind = [id, fields](Statement& st, const TabData& data){
+            auto or_null = [](double v){ return v ? optional<double>(v) : nullopt; };
+            int i = 1;
+            if (fields & TAB_URL) {
+                st.bind_param(i++, x31_hash(data.url));
+                st.bind_param(i++, data.url);
+            }
+            if (fields & TAB_TITLE) st.bind_param(i++, data.title);
+            if (fields & TAB_FAVICON) st.bind_param(i++, data.favicon);
+            if (fields & TAB_VISITED_AT) st.bind_param(i++, or_null(data.visited_at));
+            if (fields & TAB_STARRED_AT) st.bind_param(i++, or_null(data.starred_at));
+            if (fields & TAB_CLOSED_AT) st.bind_param(i++, or_null(data.closed_at));
+            for (auto& agg : aggregates) {
+                if (fields & agg.field) st.bind_param(i++, data.*agg.total);
+            }
+            st.bind_param(i++, id);
+        };
+         // Only copy the values if this is queued for the writer thread
+        if (writer.joinable()) {
+            run_write(st, [bind, data = *data](Statement& st){ bind(st, data); });
+        }
+        else run_write(st, [&](Statement& st){ bind(st, *data); });
+        tabs_written += 1;
+    }
+    dirty_tabs.clear();
+
+    for (int64 id : dirty_windows) {
+        auto data = get_window_data(id);
+        window_changing(id, data);
+        uint32 fields = data->dirty & window_flush_fields;
+        data->dirty = 0;
+        if (!fields) continue;
+        auto& st = *window_flush_statements[fields];
+        run_write(st, [id, fields, data = *data](Statement& st){
+            int i = 1;
+            if (fields & WINDOW_ROOT_TAB) st.bind_param(i++, data.root_tab);
+            if (fields & WINDOW_FOCUSED_TAB) st.bind_param(i++, data.focused_tab);
+            if (fields & WINDOW_CLOSED_AT) {
+                st.bind_param(i++, data.closed_at ? optional<double>(data.closed_at) : nullopt);
+            }
+            st.bind_param(i++, id);
+        });
+        windows_written += 1;
+    }
+    dirty_windows.clear();
+    strict_changes = false;
+    relaxed_since = 0;
+}
+
+void set_relaxed_fields (uint32 tab_fields, uint32 window_fields, double max_delay) {
+    flush_relaxed_changes();
+    relaxed_tab_fields = tab_fields;
+    relaxed_window_fields = window_fields;
+    relaxed_max_delay = max_delay;
+}
+
+void flush_relaxed_changes () {
+    if (!dirty_tabs.empty() || !dirty_windows.empty()) {
+        LOG("flush_relaxed_changes", dirty_tabs.size(), dirty_windows.size());
+        Transaction tr;
+        flush_changes();
+    }
+    flush_group_commit();
+}
+
+///// Change feed
+
+ // What changed in the transaction being committed.  This is separate from
+ // updated_tabs because those can pile up over several commits while
+ // observers are being updated.
+static std::map<int64, uint32> committing_tabs;
+static std::map<int64, uint32> committing_windows;
+
+struct LoggedChange {
+    uint64 version;
+    bool window;
+    int64 id;
+    uint32 fields;
+};
+static std::deque<LoggedChange> change_log;
+static size_t change_log_limit = 100000;
+static uint64 version = 0;
+ // changes_since anything before this is missing changes
+static uint64 change_log_start = 0;
+
+static void log_changes () {
+    if (committing_tabs.empty() && committing_windows.empty()) return;
+    version += 1;
+    for (auto& [id, fields] : committing_tabs) {
+        change_log.push_back({version, false, id, fields});
+    }
+    for (auto& [id, fields] : committing_windows) {
+        change_log.push_back({version, true, id, fields});
+    }
+    while (change_log.size() > change_log_limit) {
+        change_log_start = change_log.front().version;
+        change_log.pop_front();
+    }
+}
+
+uint64 current_version () { return version; }
+
+Changes changes_since (uint64 since) {
+    AA(since <= version);
+    Changes r {version, since >= change_log_start};
+    if (!r.complete) return r;
+    auto iter = upper_bound(change_log.begin(), change_log.end(), since,
+        [](uint64 v, const LoggedChange& c){ return v < c.version; }
+    );
+    std::map<int64, uint32> tabs;
+    std::map<int64, uint32> windows;
+    for (; iter != change_log.end(); iter++) {
+        (iter->window ? windows : tabs)[iter->id] |= iter->fields;
+    }
+    r.tabs.assign(tabs.begin(), tabs.end());
+    r.windows.assign(windows.begin(), windows.end());
+    return r;
+}
+
+void set_change_log_limit (size_t limit) {
+    change_log_limit = limit;
+    while (change_log.size() > change_log_limit) {
+        change_log_start = change_log.front().version;
+        change_log.pop_front();
+    }
+}
+
+///// Snapshots
+
+static bool snapshots_started = false;
+ // Not lock-free; see current_snapshot in snapshot.h.
+static std::atomic<shared_ptr<const TreeSnapshot>> published_snapshot;
+
+static shared_ptr<const vector<int64>> snapshot_children (int64 parent) {
+    auto r = make_shared<vector<int64>>();
+    auto iter = children_by_parent.find(parent);
+    if (iter != children_by_parent.end()) {
+        r->reserve(iter->second.all.size());
+        for (auto& [position, id] : iter->second.all) r->push_back(id);
+    }
+    return r;
+}
+
+static shared_ptr<const TabSnapshot> snapshot_tab (
+    int64 id, const TabData& t, shared_ptr<const vector<int64>> children
+) {
+    return make_shared<const TabSnapshot>(TabSnapshot{
+        id, t.parent, t.position,
+        t.child_count, t.unvisited_count, t.starred_count,
+        t.url, t.title, t.favicon,
+        t.created_at, t.visited_at, t.starred_at, t.closed_at,
+        move(children)
+    });
+}
+
+ // Makes a new snapshot from the last one and committing_tabs.  Only tabs that
+ // changed, and parents whose children changed, get new TabSnapshots.
+static void publish_snapshot () {
+    if (!snapshots_started || committing_tabs.empty()) return;
+    auto old = published_snapshot.load();
+    SnapshotBuilder builder (old.get(), version);
+
+    std::set<int64> parents;
+    for (auto& [id, fields] : committing_tabs) {
+        if (!(fields & (TAB_LOCATION | TAB_CREATED | TAB_DELETED))) continue;
+        if (auto prev = old->get(id)) parents.insert(prev->parent);
+        auto data = get_tab_data(id);
+        if (!data->deleted) parents.insert(data->parent);
+    }
+    for (auto& [id, fields] : committing_tabs) {
+        auto data = get_tab_data(id);
+        if (data->deleted) {
+            builder.set_tab(id, nullptr);
+            continue;
+        }
+        auto prev = old->get(id);
+        builder.set_tab(id, snapshot_tab(id, *data,
+            !prev || parents.count(id) ? snapshot_children(id) : prev->children
+        ));
+    }
+    for (int64 parent : parents) {
+        if (!parent) {
+            builder.set_root_children(snapshot_children(0));
+        }
+        else if (!committing_tabs.count(parent)) {
+            auto tab = make_shared<TabSnapshot>(*old->get(parent));
+            tab->children = snapshot_children(parent);
+            builder.set_tab(parent, move(tab));
+        }
+    }
+    published_snapshot.store(builder.finish());
+}
+
+void start_snapshots () {
+    LOG("start_snapshots");
+    if (snapshots_started) return;
+    Transaction tr;
+    flush_changes();
+     // Don't go through tabs_by_id, to avoid keeping every tab in it
+    State<int64, int64, Bifractor, int64, int64, int64, Str, Str, Str, double, double, double, double>
+        ::Ment<> get_all {R"(
+SELECT id, parent, position, child_count, unvisited_count, starred_count,
+    url, title, favicon, created_at, visited_at, starred_at, closed_at
+FROM tabs
+    )", true};
+    SnapshotBuilder builder (nullptr, version);
+    get_all.run_with([&](auto&& row){
+        int64 id = std::get<0>(row);
+        auto cached = tabs_by_id.find(id);
+        if (cached != tabs_by_id.end()) {
+            builder.set_tab(id, snapshot_tab(id, cached->second, snapshot_children(id)));
+        }
+        else {
+            builder.set_tab(id, snapshot_tab(id, apply([](int64, auto&&... cols){
+                return TabData(cols...);
+            }, row), snapshot_children(id)));
+        }
+    });
+    builder.set_root_children(snapshot_children(0));
+    published_snapshot.store(builder.finish());
+    snapshots_started = true;
+}
+
+shared_ptr<const TreeSnapshot> current_snapshot () {
+    return published_snapshot.load();
+}
+
 ///// Transactions
 
 static std::vector<Observer*>& all_observers () {
@@ -30,19 +1024,85 @@ static std::vector<Observer*>& all_observers () {
     return all_observers;
 }
 static std::vector<int64> updated_tabs;
+ // Subtree operations can update thousands of tabs at once, so don't search
+ // the list linearly.
+static std::unordered_set<int64> updated_tabs_set;
 static std::vector<int64> updated_windows;
 
-void tab_updated (int64 id) {
+ // Which selective observers want to hear about which tabs
+struct Interest {
+    Observer* observer;
+    uint32 depth;
+    uint32 count;
+};
+static std::unordered_map<int64, std::vector<Interest>> interests_by_tab;
+ // Only goes up, but it's only ever 2 or so anyway.
+static uint32 max_interest_depth = 0;
+
+void observe_tab (Observer* o, int64 tab, uint32 depth) {
+    AA(o->selective);
+    auto& interests = interests_by_tab[tab];
+    for (auto& i : interests) {
+        if (i.observer == o && i.depth == depth) {
+            i.count += 1;
+            return;
+        }
+    }
+    interests.push_back({o, depth, 1});
+    if (depth > max_interest_depth) max_interest_depth = depth;
+}
+
+void unobserve_tab (Observer* o, int64 tab, uint32 depth) {
+    auto iter = interests_by_tab.find(tab);
+    AA(iter != interests_by_tab.end());
+    auto& interests = iter->second;
+    for (auto i = interests.begin(); i != interests.end(); i++) {
+        if (i->observer == o && i->depth == depth) {
+            if (!--i->count) interests.erase(i);
+            if (interests.empty()) interests_by_tab.erase(iter);
+            return;
+        }
+    }
+    AA(false);
+}
+
+ // Sorts updated tabs into lists for each selective observer, by walking up
+ // from each tab as far as anyone's interested.
+static std::unordered_map<Observer*, std::vector<int64>> route_updates (
+    const std::vector<int64>& tabs
+) {
+    std::unordered_map<Observer*, std::vector<int64>> r;
+    if (interests_by_tab.empty()) return r;
+    for (int64 tab : tabs) {
+        int64 ancestor = tab;
+        for (uint32 depth = 0; depth <= max_interest_depth; depth++) {
+            auto iter = interests_by_tab.find(ancestor);
+            if (iter != interests_by_tab.end()) {
+                for (auto& i : iter->second) {
+                    if (i.depth < depth) continue;
+                    auto& routed = r[i.observer];
+                    if (routed.empty() || routed.back() != tab) routed.push_back(tab);
+                }
+            }
+            if (!ancestor) break;
+            ancestor = get_tab_data(ancestor)->parent;
+        }
+    }
+    return r;
+}
+
+void tab_updated (int64 id, uint32 fields) {
     Transaction tr;
     AA(id > 0);
-    for (auto t : updated_tabs) {
-        if (t == id) return;
+    committing_tabs[id] |= fields;
+    if (updated_tabs_set.emplace(id).second) {
+        updated_tabs.push_back(id);
     }
-    updated_tabs.push_back(id);
 }
-void window_updated (int64 id) {
+void window_updated (int64 id, uint32 fields) {
     Transaction tr;
     AA(id > 0);
+    committing_windows[id] |= fields;
     for (auto w : updated_windows) {
         if (w == id) return;
     }
@@ -60,11 +1120,20 @@ void update_observers () {
     }
     updating = true;
     auto tabs = move(updated_tabs);
+    updated_tabs_set.clear();
     auto windows = move(updated_windows);
-     // Copy the list because an observer can destroy itself
+    auto routed = route_updates(tabs);
+    static const std::vector<int64> no_tabs;
+     // Copy the list because an observer can destroy itself or others
     auto observers_copy = all_observers();
     for (auto o : observers_copy) {
-        o->Observer_after_commit(tabs, windows);
+        auto& all = all_observers();
+        if (std::find(all.begin(), all.end(), o) == all.end()) continue;
+        if (o->selective) {
+            auto iter = routed.find(o);
+            o->Observer_after_commit(iter == routed.end() ? no_tabs : iter->second, windows);
+        }
+        else o->Observer_after_commit(tabs, windows);
     }
     updating = false;
     if (again) {
@@ -74,35 +1143,170 @@ void update_observers () {
 }
 
 static size_t transaction_depth = 0;
+ // Set when a failed queued write was reported inside a transaction, so that
+ // the transaction rolls back even if the error was caught.
+static bool writes_failed = false;
+static uint64 transaction_start_writes;
+static uint64 transaction_start_statements;
+static TransactionStats last_stats;
+
+const TransactionStats& last_transaction_stats () { return last_stats; }
+
+ // With group commit, the SQLite transaction is left open after a top-level
+ // Transaction ends, and the next ones go in savepoints inside it, until
+ // group_commit_window has passed since it was opened.
+static double group_commit_window = 0;
+static bool group_open = false;
+static double group_started = 0;
+
+static State<>::Ment<> commit_transaction {"COMMIT"};
+static void commit_group () {
+    if (writer.joinable()) {
+        auto c = make_unique<WriteCommand>();
+        c->statement = &commit_transaction;
+        c->boundary = WriteCommand::ENDS_TRANSACTION;
+        c->committed = make_shared<promise<void>>();
+        last_commit = c->committed->get_future().share();
+        push_write(move(c));
+    }
+    else run_write(commit_transaction);
+    group_open = false;
+}
+
+ // After the database rolled back, throw out what the cache has from it,
+ // except for the relaxed changes that were waiting before (see
+ // saved_dirty_tabs).
+static void reload_cache () {
+    strict_changes = false;
+    restore_dirty(dirty_tabs, tabs_by_id, touched_tabs, saved_dirty_tabs, restored_tabs);
+    restore_dirty(dirty_windows, windows_by_id, touched_windows, saved_dirty_windows, restored_windows);
+    relaxed_since = saved_relaxed_since;
+    reset_undo_log();
+    tabs_by_id.clear();
+    windows_by_id.clear();
+     // Queued writes that haven't been committed yet aren't in the cache now
+    last_uncached_write = last_write_queued;
+    ids_loaded = false;
+    load_tab_index();
+}
+
+ // Inside a transaction, callers may be holding pointers into the cache, so
+ // leave it for the transaction to roll back when it ends.
+static void forget_failed_writes () {
+    if (transaction_depth) {
+        writes_failed = true;
+        return;
+    }
+    reset_undo_log();
+    reload_cache();
+}
 
+static State<>::Ment<> begin_transaction {"BEGIN"};
+static State<>::Ment<> begin_logical {"SAVEPOINT logical"};
 Transaction::Transaction () {
     AA(!uncaught_exceptions());
     if (!transaction_depth) {
-        static State<>::Ment<> begin {"BEGIN"};
-        begin.run_void();
+        transaction_start_writes = writes_run;
+        transaction_start_statements = statements_run;
+        tabs_written = 0;
+        windows_written = 0;
+        reset_undo_log();
+        if (!group_open) {
+            run_write(begin_transaction);
+            group_started = now();
+        }
+        if (group_commit_window) {
+            run_write(begin_logical, nullptr, WriteCommand::BEGINS_LOGICAL);
+            group_open = true;
+        }
     }
     transaction_depth += 1;
 }
+static State<>::Ment<> rollback_logical {"ROLLBACK TO logical"};
+static State<>::Ment<> release_logical {"RELEASE logical"};
+static State<>::Ment<> rollback_transaction {"ROLLBACK"};
 Transaction::~Transaction () {
     transaction_depth -= 1;
     if (!transaction_depth) {
-        if (uncaught_exceptions()) {
-            static State<>::Ment<> rollback {"ROLLBACK"};
-            rollback.run_void();
+        if (uncaught_exceptions() || writes_failed) {
+            writes_failed = false;
+             // Don't throw from here.  An error can make SQLite roll back
+             // the whole transaction by itself (without the writer thread,
+             // that's checked here; with it, the writer thread checks).
+            bool open = writer.joinable() || !sqlite3_get_autocommit(db);
+            try {
+                if (!open) { }
+                else if (group_open) {
+                     // Keep the transactions that already ended in this group.
+                    run_write(rollback_logical);
+                    run_write(release_logical, nullptr, WriteCommand::ENDS_LOGICAL);
+                }
+                else {
+                    run_write(rollback_transaction, nullptr, WriteCommand::ENDS_TRANSACTION);
+                }
+            }
+            catch (std::exception&) {
+                if (!writer.joinable() && !sqlite3_get_autocommit(db)) {
+                    sqlite3_exec(db, "ROLLBACK", nullptr, nullptr, nullptr);
+                }
+            }
+            if (!writer.joinable() && sqlite3_get_autocommit(db)) {
+                group_open = false;
+            }
             updated_tabs.clear();
+            updated_tabs_set.clear();
             updated_windows.clear();
-            tabs_by_id.clear();
-            windows_by_id.clear();
+            committing_tabs.clear();
+            committing_windows.clear();
+             // If a queued write failed, its error is left for the next read
+             // to throw, since it may have been in an earlier transaction in
+             // the group.
+            reload_cache();
         }
         else {
-            static State<>::Ment<> commit {"COMMIT"};
-            commit.run_void();
+             // Relaxed changes can wait, unless we're writing anyway.
+            if (strict_changes
+             || writes_run != transaction_start_writes
+             || (relaxed_since && now() - relaxed_since >= relaxed_max_delay)
+            ) {
+                flush_changes();
+            }
+            if (group_open) {
+                run_write(release_logical, nullptr, WriteCommand::ENDS_LOGICAL);
+            }
+            if (!group_open || now() - group_started >= group_commit_window) {
+                commit_group();
+            }
+            last_stats.statements = statements_run - transaction_start_statements;
+            last_stats.tabs_written = tabs_written;
+            last_stats.windows_written = windows_written;
+            reset_undo_log();
+            log_changes();
+            publish_snapshot();
+            committing_tabs.clear();
+            committing_windows.clear();
             update_observers();
         }
     }
 }
 
-Observer::Observer () { all_observers().emplace_back(this); }
+void set_group_commit_window (double window) {
+    flush_group_commit();
+    group_commit_window = window;
+}
+
+bool group_commit_pending () { return group_open; }
+
+void flush_group_commit () {
+    if (group_open && !transaction_depth) {
+        LOG("flush_group_commit");
+        commit_group();
+    }
+}
+
+Observer::Observer (bool selective) : selective(selective) {
+    all_observers().emplace_back(this);
+}
 Observer::~Observer () {
     for (auto iter = all_observers().begin(); iter != all_observers().end(); iter++) {
         if (*iter == this) {
@@ -110,29 +1314,177 @@ Observer::~Observer () {
             break;
         }
     }
+    if (selective) {
+        for (auto iter = interests_by_tab.begin(); iter != interests_by_tab.end();) {
+            std::erase_if(iter->second, [this](auto& i){ return i.observer == this; });
+            if (iter->second.empty()) iter = interests_by_tab.erase(iter);
+            else iter++;
+        }
+    }
 }
 
 ///// TAB HELPER STATEMENTS
 
-bool suspend_child_counts = false;
+static bool suspend_aggregates = false;
+
+ // Takes changes to the totals of each parent and applies them to all
+ // ancestors, stopping at (after) a closed one.  The new totals are written
+ // with the other deferred changes.
+static void apply_aggregate_deltas (const map<int64, AggregateDelta>& deltas) {
+    if (suspend_aggregates) return;
+     // Sum up the changes for every ancestor first, so that each one is only
+     // touched once no matter how many tabs were moved under it.
+    map<int64, AggregateDelta> totals;
+    for (auto& [parent, delta] : deltas) {
+        if (!delta) continue;
+        for (int64 p = parent; p > 0;) {
+            totals[p] += delta;
+            auto data = get_tab_data(p);
+            if (data->closed_at) break;
+            p = data->parent;
+        }
+    }
+    for (auto& [id, delta] : totals) {
+        auto data = get_tab_data(id);
+        tab_changing(id, data);
+        uint32 fields = 0;
+        for (size_t i = 0; i < n_aggregates; i++) {
+            if (!delta.diffs[i]) continue;
+            data->*aggregates[i].total += delta.diffs[i];
+            fields |= aggregates[i].field;
+        }
+        if (fields) tab_changed(id, data, fields);
+    }
+}
+
+static void change_aggregates (int64 parent, const AggregateDelta& delta) {
+    apply_aggregate_deltas({{parent, delta}});
+}
 
-void change_child_count (int64 parent, int64 diff) {
-    if (suspend_child_counts) return;
-    while (parent > 0) {
-        auto data = get_tab_data(parent);
-        data->child_count += diff;
-        static State<>::Ment<int64, int64> update {R"(
-UPDATE tabs SET child_count = child_count + ? WHERE id = ?
-        )"};
-        update.run_void(diff, parent);
-        tab_updated(parent);
+static State<int64, int64, Bifractor, int64, int64, int64, Str, Str, Str, double, double, double, double>
+    ::Ment<int64> get_subtree_rows {R"(
+WITH RECURSIVE subtree (id) AS (
+    SELECT ?
+    UNION ALL
+    SELECT tabs.id FROM tabs, subtree WHERE tabs.parent = subtree.id
+)
+SELECT id, parent, position, child_count, unvisited_count, starred_count,
+    url, title, favicon, created_at, visited_at, starred_at, closed_at
+FROM tabs WHERE id IN subtree
+)"};
+ // Makes sure all tabs in the subtree are in tabs_by_id, with one query
+static vector<int64> cache_subtree (int64 id) {
+    vector<int64> subtree = get_subtree(id);
+    bool missing = false;
+    for (int64 t : subtree) {
+        if (!tabs_by_id.count(t)) missing = true;
+    }
+    if (!missing) return subtree;
+
+    get_subtree_rows.run_with(id, [](auto&& row){
+        int64 t = std::get<0>(row);
+        if (tabs_by_id.count(t)) return;
+        tabs_by_id.emplace(t, apply([](int64, auto&&... cols){
+            return TabData(cols...);
+        }, row));
+    });
+    return subtree;
+}
+
+ // Recalculates the aggregates for every tab in the subtree, bottom-up.
+ // Doesn't touch the subtree root's ancestors.
+static void recount_subtree (const vector<int64>& subtree) {
+    unordered_map<int64, AggregateDelta> totals;
+    for (auto iter = subtree.rbegin(); iter != subtree.rend(); iter++) {
+        auto data = get_tab_data(*iter);
+        tab_changing(*iter, data);
+        AggregateDelta total = totals[*iter];
+        uint32 fields = 0;
+        for (size_t i = 0; i < n_aggregates; i++) {
+            if (data->*aggregates[i].total == total.diffs[i]) continue;
+            data->*aggregates[i].total = total.diffs[i];
+            fields |= aggregates[i].field;
+        }
+        if (fields) tab_changed(*iter, data, fields);
+        if (!data->closed_at) {
+            totals[data->parent] += contribution(*data);
+        }
+    }
+}
 
-        parent = data->parent;
+ // Aggregates only depend on numeric fields, so skip loading the strings.
+static Statement get_aggregate_inputs {[]{
+    String sql = "SELECT id, parent, visited_at, starred_at, closed_at";
+    for (auto& agg : aggregates) sql += ", "s + agg.column;
+    return sql + " FROM tabs";
+}().c_str()};
+static Statement set_aggregates {
+    ("UPDATE tabs SET " + aggregate_columns("?") + " WHERE id = ?").c_str()
+};
+void rebuild_tab_aggregates () {
+    LOG("rebuild_tab_aggregates");
+    Transaction tr;
+    flush_changes();
+
+    Statement& get = get_aggregate_inputs;
+    unordered_map<int64, TabData> all;
+    for (get.step(); !get.done(); get.step()) {
+        TabData t (
+            get.read_column<int64>(1), Bifractor(), 0, 0, 0, "", "", "", 0,
+            get.read_column<double>(2),
+            get.read_column<double>(3),
+            get.read_column<double>(4)
+        );
+        for (size_t i = 0; i < n_aggregates; i++) {
+            t.*aggregates[i].total = get.read_column<int64>(5 + int(i));
+        }
+        all.emplace(get.read_column<int64>(0), move(t));
+    }
+    get.reset();
+
+     // Children come after their parents in get_subtree, so go backwards.
+    vector<int64> order = get_subtree(0);
+    unordered_map<int64, AggregateDelta> totals;
+    for (auto iter = order.rbegin(); iter != order.rend() - 1; iter++) {
+        auto& data = all.at(*iter);
+        AggregateDelta total = totals[*iter];
+        bool changed = false;
+        for (size_t i = 0; i < n_aggregates; i++) {
+            if (data.*aggregates[i].total == total.diffs[i]) continue;
+            data.*aggregates[i].total = total.diffs[i];
+            changed = true;
+        }
+        if (changed) {
+            run_write(set_aggregates, [total, id = *iter](Statement& set){
+                for (size_t i = 0; i < n_aggregates; i++) {
+                    set.bind_param(1 + int(i), total.diffs[i]);
+                }
+                set.bind_param(1 + int(n_aggregates), id);
+            });
+             // Update the cached row in place, since callers may be holding
+             // pointers into tabs_by_id.
+            auto cached = tabs_by_id.find(*iter);
+            if (cached != tabs_by_id.end()) {
+                for (size_t i = 0; i < n_aggregates; i++) {
+                    cached->second.*aggregates[i].total = total.diffs[i];
+                }
+            }
+            tab_updated(*iter, aggregate_fields);
+        }
+        if (!data.closed_at) {
+            totals[data.parent] += contribution(data);
+        }
     }
+     // Most of the rows written aren't cached
+    if (writer.joinable()) last_uncached_write = last_write_queued;
 }
 
 ///// TABS
 
+static State<>::Ment<int64, int64, Bifractor, uint64, Str, Str, double> insert_tab {R"(
+INSERT INTO tabs (id, parent, position, url_hash, url, title, created_at)
+VALUES (?, ?, ?, ?, ?, ?, ?)
+)"};
 int64 create_tab (int64 reference, TabRelation rel, Str url, Str title) {
     Transaction tr;
     LOG("create_webpage_tab", reference, uint(rel), url, title);
@@ -141,82 +1493,182 @@ int64 create_tab (int64 reference, TabRelation rel, Str url, Str title) {
     Bifractor position;
     tie(parent, position) = make_location(reference, rel);
 
-    static State<>::Ment<int64, Bifractor, uint64, String, String, double> create {R"(
-INSERT INTO tabs (parent, position, url_hash, url, title, created_at)
-VALUES (?, ?, ?, ?, ?, ?)
-    )"};
-    create.run_void(parent, position, x31_hash(url), String(url), String(title), now());
-    int64 id = sqlite3_last_insert_rowid(db);
-    tab_updated(id);
-
-    change_child_count(parent, 1);
+    double created_at = now();
+    int64 id = new_tab_id();
+    run_write(insert_tab, id, parent, position, x31_hash(url), url, title, created_at);
+     // Ids of deleted tabs can be reused, so get rid of any stale data
+    tabs_by_id.erase(id);
+    auto& data = tabs_by_id.emplace(id, TabData(
+        parent, position, 0, 0, 0, url, title, "", created_at, 0, 0, 0
+    )).first->second;
+    index_add(id, parent, position, false);
+    tab_updated(id, TAB_CREATED);
+
+    change_aggregates(parent, contribution(data));
+    rekey_if_long(parent, span(&position, 1));
     return id;
 }
 
+static MultiInsert<int64, int64, Bifractor, uint64, Str, Str, double> insert_tabs {
+    "INSERT INTO tabs (id, parent, position, url_hash, url, title, created_at)"
+};
+vector<int64> create_tabs (int64 reference, TabRelation rel, span<const NewTab> tabs) {
+    Transaction tr;
+    LOG("create_tabs", reference, uint(rel), tabs.size());
+
+    auto [parent, low, high] = location_bounds(reference, rel);
+    vector<Bifractor> positions;
+    positions.reserve(tabs.size());
+    spread_bifractors(positions, low, high, tabs.size());
+
+    double created_at = now();
+    vector<int64> ids;
+    ids.reserve(tabs.size());
+    AggregateDelta delta;
+    vector<tuple<int64, int64, Bifractor, uint64, Str, Str, double>> rows;
+    rows.reserve(tabs.size());
+    for (size_t i = 0; i < tabs.size(); i++) {
+        int64 id = new_tab_id();
+        rows.emplace_back(
+            id, parent, positions[i], x31_hash(tabs[i].url),
+            tabs[i].url, tabs[i].title, created_at
+        );
+        tabs_by_id.erase(id);
+        auto& data = tabs_by_id.emplace(id, TabData(
+            parent, positions[i], 0, 0, 0, tabs[i].url, tabs[i].title, "",
+            created_at, 0, 0, 0
+        )).first->second;
+        index_add(id, parent, positions[i], false);
+        tab_updated(id, TAB_CREATED);
+        ids.push_back(id);
+        delta += contribution(data);
+    }
+     // The writer thread can only queue single statements
+    if (writer.joinable()) {
+        for (auto& row : rows) {
+            apply([](auto&... params){ run_write(insert_tab, params...); }, row);
+        }
+    }
+    else {
+        insert_tabs.run(rows);
+        writes_run += 1;
+    }
+
+    change_aggregates(parent, delta);
+    rekey_if_long(parent, positions);
+    return ids;
+}
+
+template <>
+struct RowFields<TabData> {
+    static constexpr auto list = std::tuple(
+        &TabData::parent, &TabData::position, &TabData::child_count,
+        &TabData::unvisited_count, &TabData::starred_count,
+        &TabData::url, &TabData::title, &TabData::favicon, &TabData::created_at,
+        &TabData::visited_at, &TabData::starred_at, &TabData::closed_at
+    );
+};
+static State<int64, Bifractor, int64, int64, int64, String, String, String, double, double, double, double>
+    ::Ment<int64> get_tab_row {R"(
+SELECT parent, position, child_count, unvisited_count, starred_count,
+    url, title, favicon, created_at, visited_at, starred_at, closed_at
+FROM tabs WHERE id = ?
+)"};
 TabData* get_tab_data (int64 id) {
     auto iter = tabs_by_id.find(id);
     if (iter != tabs_by_id.end()) {
         return &iter->second;
     }
 
-    static State<int64, Bifractor, int64, String, String, String, double, double, double, double>
-        ::Ment<int64> get {R"(
-SELECT parent, position, child_count, url, title, favicon, created_at, visited_at, starred_at, closed_at
-FROM tabs WHERE id = ?
-    )"};
-
-     // This make_from_tuple does an extra copy, might be worth trying to fix
-    auto res = tabs_by_id.emplace(id, make_from_tuple<TabData>(get.run_single(id)));
-    return &res.first->second;
+     // Only put the row in the cache once it's been read completely
+    TabData data;
+    AA(get_tab_row.run_into(id, data));
+    apply_restored(id, data);
+    return &tabs_by_id.emplace(id, move(data)).first->second;
 }
 
 std::vector<int64> get_all_children (int64 parent) {
     LOG("get_all_children", parent);
-    static State<int64>::Ment<int64> get {R"(
-SELECT id FROM tabs WHERE parent = ? ORDER BY position
-    )"};
-    return get.run(parent);
+    std::vector<int64> r;
+    auto iter = children_by_parent.find(parent);
+    if (iter == children_by_parent.end()) return r;
+    r.reserve(iter->second.all.size());
+    for (auto& [position, id] : iter->second.all) {
+        r.push_back(id);
+    }
+    return r;
 }
 
 std::vector<int64> get_all_unclosed_children (int64 parent) {
     LOG("get_all_unclosed_children", parent);
-    static State<int64>::Ment<int64> get {R"(
-SELECT id FROM tabs WHERE parent = ? AND closed_at IS NULL ORDER BY position
-    )"};
-    return get.run(parent);
+    std::vector<int64> r;
+    auto iter = children_by_parent.find(parent);
+    if (iter == children_by_parent.end()) return r;
+    r.reserve(iter->second.unclosed.size());
+    for (auto& [position, id] : iter->second.unclosed) {
+        r.push_back(id);
+    }
+    return r;
 }
 
+ // Tabs that have never been visited are left out, since they have no order
+ // among themselves to keep in memory.
+static State<int64, double>::Ment<int64> get_last_visited {R"(
+SELECT id, visited_at FROM tabs WHERE closed_at IS NULL AND visited_at IS NOT NULL
+ORDER BY visited_at DESC LIMIT ?
+)"};
 std::vector<int64> get_last_visited_tabs (int n_tabs) {
-     // TODO: create index
     LOG("get_last_visited_tabs", n_tabs);
-    static State<int64>::Ment<int64> get {R"(
-SELECT id FROM tabs WHERE closed_at IS NULL ORDER BY visited_at DESC LIMIT ?
-    )"};
-    return get.run(n_tabs);
+    std::vector<int64> r;
+    if (recent_tabs_complete || recent_tabs.size() >= size_t(n_tabs)) {
+        r.reserve(n_tabs);
+        for (auto& [visited_at, id] : recent_tabs) {
+            if (r.size() == size_t(n_tabs)) break;
+            r.push_back(id);
+        }
+        return r;
+    }
+     // Not enough in memory, so go to the database (this uses the
+     // unclosed_tabs_by_visited_at index) and remember what it says.
+    flush_changes();
+    recency_clear();
+    for (auto& [id, visited_at] : get_last_visited.run(n_tabs)) {
+        r.push_back(id);
+        recent_tabs.emplace_back(visited_at, id);
+        recent_tabs_by_id.emplace(id, prev(recent_tabs.end()));
+    }
+    recent_tabs_complete = r.size() < size_t(n_tabs);
+    return r;
 }
 
 String get_tab_url (int64 id) {
     return get_tab_data(id)->url;
 }
 
+static int64 index_prev_unclosed (int64 parent, const Bifractor& position) {
+    auto& siblings = index_children(parent).unclosed;
+    auto iter = siblings.lower_bound(position);
+    if (iter == siblings.begin()) return 0;
+    return prev(iter)->second;
+}
+
+static int64 index_next_unclosed (int64 parent, const Bifractor& position) {
+    auto& siblings = index_children(parent).unclosed;
+    auto iter = siblings.upper_bound(position);
+    if (iter == siblings.end()) return 0;
+    return iter->second;
+}
+
 int64 get_prev_unclosed_tab (int64 id) {
     LOG("get_prev_unclosed_tab", id);
-
     auto data = get_tab_data(id);
-    State<int64>::Ment<int64, Bifractor> get {R"(
-SELECT id FROM tabs WHERE parent = ? AND position < ? AND closed_at IS NULL ORDER BY position DESC LIMIT 1
-    )"};
-    return get.run_or(data->parent, data->position, 0);
+    return index_prev_unclosed(data->parent, data->position);
 }
 
 int64 get_next_unclosed_tab (int64 id) {
     LOG("get_next_unclosed_tab", id);
-
     auto data = get_tab_data(id);
-    State<int64>::Ment<int64, Bifractor> get {R"(
-SELECT id FROM tabs WHERE parent = ? AND position > ? AND closed_at IS NULL ORDER BY position ASC LIMIT 1
-    )"};
-    return get.run_or(data->parent, data->position, 0);
+    return index_next_unclosed(data->parent, data->position);
 }
 
 void set_tab_url (int64 id, Str url) {
@@ -226,12 +1678,9 @@ void set_tab_url (int64 id, Str url) {
     if (utf8_url == data->url) return;
 
     Transaction tr;
+    tab_changing(id, data);
     data->url = utf8_url;
-    static State<>::Ment<uint64, String, int64> set {R"(
-UPDATE tabs SET url_hash = ?, url = ? WHERE id = ?
-    )"};
-    set.run_void(x31_hash(utf8_url), utf8_url, id);
-    tab_updated(id);
+    tab_changed(id, data, TAB_URL);
 }
 
 void set_tab_title (int64 id, Str title) {
@@ -240,12 +1689,9 @@ void set_tab_title (int64 id, Str title) {
     if (title == data->title) return;
 
     Transaction tr;
+    tab_changing(id, data);
     data->title = title;
-    static State<>::Ment<String, int64> set {R"(
-UPDATE tabs SET title = ? WHERE id = ?
-    )"};
-    set.run_void(String(title), id);
-    tab_updated(id);
+    tab_changed(id, data, TAB_TITLE);
 }
 
 void set_tab_favicon (int64 id, Str favicon) {
@@ -254,35 +1700,34 @@ void set_tab_favicon (int64 id, Str favicon) {
     if (favicon == data->favicon) return;
 
     Transaction tr;
+    tab_changing(id, data);
     data->favicon = favicon;
-    static State<>::Ment<String, int64> set {R"(
-UPDATE tabs SET favicon = ? WHERE id = ?
-    )"};
-    set.run_void(String(favicon), id);
-    tab_updated(id);
+    tab_changed(id, data, TAB_FAVICON);
 }
 
 void set_tab_visited (int64 id) {
     LOG("set_tab_visited", id);
     Transaction tr;
 
-    double visited_at = now();
-    get_tab_data(id)->visited_at = visited_at;
-    static State<>::Ment<double, int64> set {R"(
-UPDATE tabs SET visited_at = ? WHERE id = ?
-    )"};
-    set.run_void(visited_at, id);
-    tab_updated(id);
+    auto data = get_tab_data(id);
+    AggregateDelta old = contribution(*data);
+    tab_changing(id, data);
+    data->visited_at = now();
+    tab_changed(id, data, TAB_VISITED_AT);
+    if (!data->closed_at) {
+        recency_visit(id, data->visited_at);
+        change_aggregates(data->parent, contribution(*data) - old);
+    }
 }
 
 void set_tab_starred_at (int64 id, optional<double> starred_at) {
     Transaction tr;
-    get_tab_data(id)->starred_at = starred_at.value_or(0);
-    static State<>::Ment<optional<double>, int64> set {R"(
-UPDATE tabs SET starred_at = ? WHERE id = ?
-    )"};
-    set.run_void(starred_at, id);
-    tab_updated(id);
+    auto data = get_tab_data(id);
+    AggregateDelta old = contribution(*data);
+    tab_changing(id, data);
+    data->starred_at = starred_at.value_or(0);
+    tab_changed(id, data, TAB_STARRED_AT);
+    if (!data->closed_at) change_aggregates(data->parent, contribution(*data) - old);
 }
 
 void star_tab (int64 id) {
@@ -295,24 +1740,43 @@ void unstar_tab (int64 id) {
     set_tab_starred_at(id, nullopt);
 }
 
+static State<int64>::Ment<> find_last_closed_tab {R"(
+SELECT id FROM tabs WHERE closed_at IS NOT NULL
+ORDER BY closed_at DESC LIMIT 1
+)"};
 int64 get_last_closed_tab () {
     LOG("get_last_closed_tab");
     Transaction tr;
+    flush_changes();
 
-    static State<int64>::Ment<> find {R"(
-SELECT id FROM tabs WHERE closed_at IS NOT NULL
-ORDER BY closed_at DESC LIMIT 1
-    )"};
-    return find.run_or(0);
+    return find_last_closed_tab.run_or(0);
 }
 
 void set_tab_closed_at (int64 id, optional<double> closed_at) {
-    get_tab_data(id)->closed_at = closed_at.value_or(0);
-    static State<>::Ment<optional<double>, int64> set {R"(
-UPDATE tabs SET closed_at = ? WHERE id = ?
-    )"};
-    set.run_void(closed_at, id);
-    tab_updated(id);
+    Transaction tr;
+    auto data = get_tab_data(id);
+    tab_changing(id, data);
+    data->closed_at = closed_at.value_or(0);
+    index_set_closed(data->parent, data->position, !!closed_at);
+    if (closed_at) recency_remove(id);
+    else recency_unclose(id, data->visited_at);
+    tab_changed(id, data, TAB_CLOSED_AT);
+}
+
+static void refocus_windows () {
+     // If any windows are focusing a closed tab, have them move their focus
+    for (auto w : get_all_unclosed_windows()) {
+        int64 successor = get_window_data(w)->focused_tab;
+        if (!get_tab_data(successor)->closed_at) continue;
+        while (get_tab_data(successor)->closed_at) {
+            auto s = get_next_unclosed_tab(successor);
+            if (!s) s = get_tab_data(successor)->parent;
+            if (!s) s = get_prev_unclosed_tab(successor);
+            if (!s) s = create_tab(0, TabRelation::LAST_CHILD, "about:blank");
+            successor = s;
+        }
+        set_window_focused_tab(w, successor);
+    }
 }
 
 void close_tab (int64 id) {
@@ -323,23 +1787,9 @@ void close_tab (int64 id) {
     if (data->closed_at) return;
 
     set_tab_closed_at(id, now());
-    change_child_count(data->parent, -1 - data->child_count);
+    change_aggregates(data->parent, -contribution(*data));
     prune_closed_tabs(20, 15*60);
-
-     // If any windows are focusing this tab, have them move their focus
-    int64 successor = id;
-    for (auto w : get_all_unclosed_windows()) {
-        if (get_window_data(w)->focused_tab == id) {
-            while (get_tab_data(successor)->closed_at) {
-                auto s = get_next_unclosed_tab(successor);
-                if (!s) s = get_tab_data(successor)->parent;
-                if (!s) s = get_prev_unclosed_tab(successor);
-                if (!s) s = create_tab(0, TabRelation::LAST_CHILD, "about:blank");
-                successor = s;
-            }
-            set_window_focused_tab(w, successor);
-        }
-    }
+    refocus_windows();
 }
 
 void close_tab_with_heritage (int64 id) {
@@ -349,9 +1799,7 @@ void close_tab_with_heritage (int64 id) {
     vector<int64> children = get_all_unclosed_children(id);
     if (!children.empty()) {
         int64 heir = children[0];
-        for (size_t i = 1; i < children.size(); i++) {
-            move_tab(children[i], heir, TabRelation::LAST_CHILD);
-        }
+        move_tabs(span(children).subspan(1), heir, TabRelation::LAST_CHILD);
         move_tab(heir, id, TabRelation::AFTER);
     }
     close_tab(id);
@@ -364,135 +1812,416 @@ void unclose_tab (int64 id) {
     auto data = get_tab_data(id);
     if (!get_tab_data(id)->closed_at) return;
     set_tab_closed_at(id, nullopt);
-    change_child_count(data->parent, 1 + data->child_count);
+    change_aggregates(data->parent, contribution(*data));
 }
 
-void delete_tab_and_children (int64 id) {
-    LOG("delete_tab_and_children", id);
-    Transaction tr;
-
+static State<>::Ment<int64> delete_subtree {R"(
+WITH RECURSIVE subtree (id) AS (
+    SELECT ?
+    UNION ALL
+    SELECT tabs.id FROM tabs, subtree WHERE tabs.parent = subtree.id
+)
+DELETE FROM tabs WHERE id IN subtree
+)"};
+ // Everything but the DELETE
+static void forget_subtree (int64 id) {
+    vector<int64> subtree = cache_subtree(id);
     auto data = get_tab_data(id);
-    for (int64 child : get_all_children(id)) {
-        delete_tab_and_children(child);
+    if (!data->closed_at) {
+        change_aggregates(data->parent, -contribution(*data));
     }
-    data->deleted = true;
 
-    static State<>::Ment<int64> do_it {R"(
-DELETE FROM tabs WHERE id = ?
-    )"};
-    do_it.run_void(id);
-    tab_updated(id);
+    index_remove(data->parent, data->position);
+    for (int64 t : subtree) {
+        children_by_parent.erase(t);
+        recency_remove(t);
+        get_tab_data(t)->deleted = true;
+        tab_updated(t, TAB_DELETED);
+    }
 }
 
-void prune_closed_tabs (int64 more_than, double older_than) {
-    LOG("prune_closed_tabs", more_than, older_than);
+void delete_tab_and_children (int64 id) {
+    LOG("delete_tab_and_children", id);
     Transaction tr;
+    flush_changes();
+    forget_subtree(id);
+    run_write(delete_subtree, id);
+}
 
-    static State<int64>::Ment<int64, double> find {R"(
+static State<int64>::Ment<int64, double> find_prunable_tabs {R"(
 SELECT id FROM (
     SELECT id, closed_at FROM tabs
     WHERE closed_at IS NOT NULL
     ORDER BY closed_at DESC LIMIT -1 OFFSET ?
 )
 WHERE closed_at < ?
-    )"};
-    auto pruned_tabs = find.run(more_than, now() - older_than);
-    for (int64 tab : pruned_tabs) {
-        delete_tab_and_children(tab);
+)"};
+void prune_closed_tabs (int64 more_than, double older_than) {
+    LOG("prune_closed_tabs", more_than, older_than);
+    Transaction tr;
+    flush_changes();
+
+     // With the writer thread, the query may not see queued writes (see
+     // cache_covers), so check the cache for closes that were undone.  It
+     // doesn't count tabs closed by queued writes either, which can only make
+     // it keep more than more_than.  The rows are deleted after the query is
+     // done with them, so tabs in subtrees that were already pruned still
+     // come out.
+    double closed_before = now() - older_than;
+    vector<tuple<int64>> pruned;
+    for (int64 tab : find_prunable_tabs.iterate(more_than, closed_before)) {
+        auto data = get_tab_data(tab);
+        if (data->deleted || !data->closed_at || data->closed_at >= closed_before) continue;
+        forget_subtree(tab);
+        pruned.emplace_back(tab);
     }
+    run_write_batch(delete_subtree, pruned);
 }
 
+static State<>::Ment<int64, Bifractor, int64> set_location {R"(
+UPDATE tabs SET parent = ?, position = ? WHERE id = ?
+)"};
 void move_tab (int64 id, int64 parent, const Bifractor& position) {
     LOG("move_tab", id, parent, position);
     Transaction tr;
 
     auto data = get_tab_data(id);
     if (!data->closed_at) {
-        change_child_count(data->parent, -1 - data->child_count);
+        change_aggregates(data->parent, -contribution(*data));
     }
 
+    index_remove(data->parent, data->position);
     data->parent = parent;
     data->position = position;
-    static State<>::Ment<int64, Bifractor, int64> set {R"(
-UPDATE tabs SET parent = ?, position = ? WHERE id = ?
-    )"};
-    set.run_void(parent, position, id);
-    tab_updated(id);
+    index_add(id, parent, position, !!data->closed_at);
+    run_write(set_location, parent, position, id);
+    tab_updated(id, TAB_LOCATION);
 
     if (!data->closed_at) {
-        change_child_count(parent, 1 + data->child_count);
+        change_aggregates(parent, contribution(*data));
     }
 }
 void move_tab (int64 id, int64 reference, TabRelation rel) {
+    Transaction tr;
     int64 parent;
     Bifractor position;
     tie(parent, position) = make_location(reference, rel);
     move_tab(id, parent, position);
+    rekey_if_long(parent, span(&position, 1));
 }
 
-pair<int64, Bifractor> make_location (int64 reference, TabRelation rel) {
+void move_tabs (span<const int64> ids, int64 reference, TabRelation rel) {
+    LOG("move_tabs", ids.size(), reference, uint(rel));
+    if (ids.empty()) return;
+    Transaction tr;
+
+    auto [parent, low, high] = location_bounds(reference, rel);
+    vector<Bifractor> positions;
+    positions.reserve(ids.size());
+    spread_bifractors(positions, low, high, ids.size());
+
+    map<int64, AggregateDelta> deltas;
+    vector<tuple<int64, Bifractor, int64>> locations;
+    locations.reserve(ids.size());
+    for (size_t i = 0; i < ids.size(); i++) {
+        auto data = get_tab_data(ids[i]);
+        if (!data->closed_at) {
+            AggregateDelta c = contribution(*data);
+            deltas[data->parent] += -c;
+            deltas[parent] += c;
+        }
+        index_remove(data->parent, data->position);
+        data->parent = parent;
+        data->position = positions[i];
+        index_add(ids[i], parent, positions[i], !!data->closed_at);
+        locations.emplace_back(parent, positions[i], ids[i]);
+        tab_updated(ids[i], TAB_LOCATION);
+    }
+    run_write_batch(set_location, locations);
+    apply_aggregate_deltas(deltas);
+    rekey_if_long(parent, positions);
+}
+
+static size_t rekey_threshold = Bifractor::inline_capacity;
+
+ // Gives some of parent's children new positions.  ids must be in order and
+ // next to each other, and positions must be in order between the positions
+ // of the siblings on either side of them.
+static void reposition_children (
+    int64 parent, const vector<int64>& ids, const vector<Bifractor>& positions
+) {
+    AA(ids.size() == positions.size());
+    Transaction tr;
+    auto& children = children_by_parent.at(parent);
+
+     // tabs_by_location is checked after every row, so a tab can't be given a
+     // position that a sibling still has.  Every tab whose position goes down
+     // can only take a position from a sibling before it that also goes down,
+     // and vice versa, so write the ones going down from first to last, then
+     // the ones going up from last to first.
+    vector<tuple<int64, Bifractor, int64>> down;
+    vector<tuple<int64, Bifractor, int64>> up;
+    vector<pair<int64, TabData*>> moved;
+    for (size_t i = 0; i < ids.size(); i++) {
+        auto data = get_tab_data(ids[i]);
+        if (positions[i] == data->position) continue;
+        (positions[i] < data->position ? down : up).emplace_back(
+            parent, positions[i], ids[i]
+        );
+         // Take them all out before putting any back, for the same reason
+        children.all.erase(data->position);
+        children.unclosed.erase(data->position);
+        data->position = positions[i];
+        moved.emplace_back(ids[i], data);
+        tab_updated(ids[i], TAB_LOCATION);
+    }
+    for (auto& [id, data] : moved) {
+        children.all.emplace(index_arena.copy(data->position), id);
+        if (!data->closed_at) {
+            children.unclosed.emplace(index_arena.copy(data->position), id);
+        }
+    }
+    if (index_arena.bytes_used() > index_arena_limit) index_compact();
+
+    down.insert(down.end(), up.rbegin(), up.rend());
+    run_write_batch(set_location, down);
+}
+
+void rekey_children (int64 parent) {
+    LOG("rekey_children", parent);
+    auto& all = index_children(parent).all;
+    if (all.empty()) return;
+    vector<int64> ids;
+    ids.reserve(all.size());
+    for (auto& [position, id] : all) ids.push_back(id);
+    vector<Bifractor> positions;
+    positions.reserve(ids.size());
+    spread_bifractors(positions, Bifractor(0), Bifractor(1), ids.size());
+    reposition_children(parent, ids, positions);
+}
+
+ // Rekeys the siblings around a position that got too long, starting with a
+ // few on each side and doubling until their new positions fit in half the
+ // threshold.  That leaves room for a good many more moves into the same gap
+ // before it has to happen again, and most of the time it doesn't touch the
+ // rest of the siblings.
+static void rekey_around (int64 parent, const Bifractor& position) {
+    LOG("rekey_around", parent);
+    auto& all = index_children(parent).all;
+    auto center = all.find(position);
+    AA(center != all.end());
+    for (size_t radius = 4;; radius *= 2) {
+        auto first = center;
+        for (size_t i = 0; i < radius && first != all.begin(); i++) --first;
+        auto last = next(center);
+        for (size_t i = 0; i < radius && last != all.end(); i++) ++last;
+        bool everything = first == all.begin() && last == all.end();
+
+        Bifractor low = first == all.begin() ? Bifractor(0) : prev(first)->first;
+        Bifractor high = last == all.end() ? Bifractor(1) : last->first;
+        vector<Bifractor> positions;
+        positions.reserve(distance(first, last));
+        spread_bifractors(positions, low, high, distance(first, last));
+        size_t longest = 0;
+        for (auto& p : positions) longest = max(longest, p.size);
+        if (longest > rekey_threshold / 2 && !everything) continue;
+
+        vector<int64> ids;
+        ids.reserve(positions.size());
+        for (auto iter = first; iter != last; ++iter) ids.push_back(iter->second);
+        reposition_children(parent, ids, positions);
+        return;
+    }
+}
+
+void set_rekey_threshold (size_t threshold) {
+    rekey_threshold = threshold;
+}
+
+ // Called on positions that were just made by bisecting.  Rekeying around
+ // one of them may already have rekeyed the others.
+static void rekey_if_long (int64 parent, span<const Bifractor> positions) {
+    for (auto& position : positions) {
+        if (position.size > rekey_threshold &&
+            index_children(parent).all.contains(position)
+        ) {
+            rekey_around(parent, position);
+        }
+    }
+}
+
+tuple<int64, Bifractor, Bifractor> location_bounds (int64 reference, TabRelation rel) {
     switch (rel) {
     case TabRelation::BEFORE: {
         TabData* ref = get_tab_data(reference);
-        static State<Bifractor>::Ment<int64, Bifractor> get_prev {R"(
-SELECT position FROM tabs WHERE parent = ? AND position < ? ORDER BY position DESC LIMIT 1
-        )"};
-        Bifractor prev = get_prev.run_or(ref->parent, ref->position, Bifractor(0));
-        return pair(
+        auto& siblings = index_children(ref->parent).all;
+        auto iter = siblings.lower_bound(ref->position);
+        return tuple(
             ref->parent,
-            Bifractor(prev, ref->position, 15/16.0)
+            iter == siblings.begin() ? Bifractor(0) : prev(iter)->first,
+            ref->position
         );
     }
     case TabRelation::AFTER: {
         TabData* ref = get_tab_data(reference);
-        static State<Bifractor>::Ment<int64, Bifractor> get_next {R"(
-SELECT position FROM tabs WHERE parent = ? AND position > ? ORDER BY position ASC LIMIT 1
-        )"};
-        Bifractor next = get_next.run_or(ref->parent, ref->position, Bifractor(1));
-        return pair(
+        auto& siblings = index_children(ref->parent).all;
+        auto iter = siblings.upper_bound(ref->position);
+        return tuple(
             ref->parent,
-            Bifractor(ref->position, next, 1/16.0)
+            ref->position,
+            iter == siblings.end() ? Bifractor(1) : iter->first
         );
     }
     case TabRelation::FIRST_CHILD: {
-        static State<Bifractor>::Ment<int64> get_first {R"(
-SELECT position FROM tabs WHERE parent = ? ORDER BY position ASC LIMIT 1
-        )"};
-        Bifractor first = get_first.run_or(reference, Bifractor(1));
-        return pair(
+        auto iter = children_by_parent.find(reference);
+        return tuple(
             reference,
-            Bifractor(Bifractor(0), first, 31/32.0)
+            Bifractor(0),
+            iter == children_by_parent.end()
+                ? Bifractor(1) : iter->second.all.begin()->first
         );
     }
     case TabRelation::LAST_CHILD: {
-        static State<Bifractor>::Ment<int64> get_last {R"(
-SELECT position FROM tabs WHERE parent = ? ORDER BY position DESC LIMIT 1
-        )"};
-        Bifractor last = get_last.run_or(reference, Bifractor(0));
-        return pair(
+        auto iter = children_by_parent.find(reference);
+        return tuple(
             reference,
-            Bifractor(last, Bifractor(1), 1/32.0)
+            iter == children_by_parent.end()
+                ? Bifractor(0) : iter->second.all.rbegin()->first,
+            Bifractor(1)
         );
     }
-    default: throw std::logic_error("make_location called with invalid TabRelation");
+    default: throw std::logic_error("location_bounds called with invalid TabRelation");
+    }
+}
+
+pair<int64, Bifractor> make_location (int64 reference, TabRelation rel) {
+     // Bias towards the reference, so that repeatedly inserting in the same
+     // place doesn't make the position grow as fast.
+    float bias;
+    switch (rel) {
+        case TabRelation::BEFORE: bias = 15/16.0; break;
+        case TabRelation::AFTER: bias = 1/16.0; break;
+        case TabRelation::FIRST_CHILD: bias = 31/32.0; break;
+        case TabRelation::LAST_CHILD: bias = 1/32.0; break;
+        default: throw std::logic_error("make_location called with invalid TabRelation");
+    }
+    auto [parent, low, high] = location_bounds(reference, rel);
+    return pair(parent, Bifractor(low, high, bias));
+}
+
+///// SUBTREES
+
+ // Walks the in-memory index, so doesn't touch the database.  Parents come
+ // before their children.
+vector<int64> get_subtree (int64 id) {
+    vector<int64> r {id};
+    for (size_t i = 0; i < r.size(); i++) {
+        auto iter = children_by_parent.find(r[i]);
+        if (iter == children_by_parent.end()) continue;
+        for (auto& [position, child] : iter->second.all) {
+            r.push_back(child);
+        }
     }
+    return r;
+}
+
+static State<>::Ment<double, int64> close_subtree {(R"(
+WITH RECURSIVE subtree (id) AS (
+    SELECT ?2
+    UNION ALL
+    SELECT tabs.id FROM tabs, subtree WHERE tabs.parent = subtree.id
+)
+UPDATE tabs SET closed_at = coalesce(closed_at, ?1), )" + aggregate_columns("0") + R"(
+WHERE id IN subtree
+)").c_str()};
+void close_tab_and_children (int64 id) {
+    LOG("close_tab_and_children", id);
+    Transaction tr;
+    flush_changes();
+
+    vector<int64> subtree = cache_subtree(id);
+    auto data = get_tab_data(id);
+    double closed_at = data->closed_at ? data->closed_at : now();
+    if (!data->closed_at) {
+        change_aggregates(data->parent, -contribution(*data));
+    }
+
+    run_write(close_subtree, closed_at, id);
+
+    for (int64 t : subtree) {
+        auto d = get_tab_data(t);
+        if (!d->closed_at) {
+            d->closed_at = closed_at;
+            index_set_closed(d->parent, d->position, true);
+            recency_remove(t);
+        }
+        for (auto& agg : aggregates) d->*agg.total = 0;
+        tab_updated(t, TAB_CLOSED_AT | aggregate_fields);
+    }
+    prune_closed_tabs(20, 15*60);
+    refocus_windows();
+}
+
+static State<>::Ment<double, int64> unclose_subtree {R"(
+WITH RECURSIVE subtree (id) AS (
+    SELECT ?2
+    UNION ALL
+    SELECT tabs.id FROM tabs, subtree WHERE tabs.parent = subtree.id
+)
+UPDATE tabs SET closed_at = NULL
+WHERE id IN subtree AND closed_at = ?1
+)"};
+void unclose_tab_and_children (int64 id) {
+    LOG("unclose_tab_and_children", id);
+    Transaction tr;
+    flush_changes();
+
+    vector<int64> subtree = cache_subtree(id);
+    auto data = get_tab_data(id);
+    if (!data->closed_at) return;
+    double closed_at = data->closed_at;
+
+     // Only unclose tabs that were closed at the same time as this one
+    run_write(unclose_subtree, closed_at, id);
+
+    for (int64 t : subtree) {
+        auto d = get_tab_data(t);
+        if (d->closed_at == closed_at) {
+            d->closed_at = 0;
+            index_set_closed(d->parent, d->position, false);
+            recency_unclose(t, d->visited_at);
+            tab_updated(t, TAB_CLOSED_AT);
+        }
+    }
+    recount_subtree(subtree);
+    change_aggregates(data->parent, contribution(*data));
 }
 
 ///// WINDOWS
 
+static State<>::Ment<int64, int64, int64, double> insert_window {R"(
+INSERT INTO windows (id, root_tab, focused_tab, created_at) VALUES (?, ?, ?, ?)
+)"};
 int64 create_window (int64 root_tab, int64 focused_tab) {
     LOG("create_window", focused_tab);
     Transaction tr;
 
-    static State<>::Ment<int64, int64, double> create {R"(
-INSERT INTO windows (root_tab, focused_tab, created_at) VALUES (?, ?, ?)
-    )"};
-    create.run_void(root_tab, focused_tab, now());
-    int64 id = sqlite3_last_insert_rowid(db);
-    window_updated(id);
+    int64 id = new_window_id();
+    run_write(insert_window, id, root_tab, focused_tab, now());
+    window_updated(id, WINDOW_CREATED);
     return id;
 }
 
+template <>
+struct RowFields<WindowData> {
+    static constexpr auto list = std::tuple(
+        &WindowData::id, &WindowData::root_tab, &WindowData::focused_tab,
+        &WindowData::created_at, &WindowData::closed_at
+    );
+};
+static State<int64, int64, int64, double, double>::Ment<int64> get_window_row {R"(
+SELECT id, root_tab, focused_tab, created_at, closed_at FROM windows WHERE id = ?
+)"};
 WindowData* get_window_data (int64 id) {
     LOG("get_window_data", id);
 
@@ -501,64 +2230,81 @@ WindowData* get_window_data (int64 id) {
         return &iter->second;
     }
 
-    static State<int64, int64, int64, double, double>::Ment<int64> get {R"(
-SELECT id, root_tab, focused_tab, created_at, closed_at FROM windows WHERE id = ?
-    )"};
-    auto res = windows_by_id.emplace(id, make_from_tuple<WindowData>(get.run_single(id)));
-    return &res.first->second;
+     // Only put the row in the cache once it's been read completely
+    WindowData data;
+    AA(get_window_row.run_into(id, data));
+    apply_restored(id, data);
+    return &windows_by_id.emplace(id, move(data)).first->second;
 }
 
+static State<int64>::Ment<> get_unclosed_windows {R"(
+SELECT id FROM windows WHERE closed_at IS NULL
+)"};
+ // Cached windows are taken from the cache, so this doesn't have to wait for
+ // queued writes to them.
 vector<int64> get_all_unclosed_windows () {
     LOG("get_all_unclosed_windows");
+    flush_changes();
 
-    static State<int64>::Ment<> get {R"(
-SELECT id FROM windows WHERE closed_at IS NULL
-    )"};
-    return get.run();
+    vector<int64> r;
+    for (int64 id : get_unclosed_windows.run()) {
+        if (!windows_by_id.count(id)) r.push_back(id);
+    }
+    for (auto& [id, data] : windows_by_id) {
+        if (!data.closed_at) r.push_back(id);
+    }
+    std::sort(r.begin(), r.end());
+    return r;
 }
 
+ // Every row a queued write is writing to is in the cache (unless
+ // last_uncached_write says otherwise), and these only read rows the cache
+ // doesn't have, or have their results checked against it.
+static bool cache_covers (Statement& st) {
+    return &st == &get_tab_row
+        || &st == &get_window_row
+        || &st == &get_subtree_rows
+        || &st == &find_prunable_tabs
+        || &st == &get_unclosed_windows;
+}
+
+static State<int64>::Ment<> find_last_closed_window {R"(
+SELECT id FROM windows WHERE closed_at IS NOT NULL ORDER BY closed_at DESC LIMIT 1
+)"};
 int64 get_last_closed_window () {
     LOG("get_last_closed_window");
+    flush_changes();
 
-    static State<int64>::Ment<> get {R"(
-SELECT id FROM windows WHERE closed_at IS NOT NULL ORDER BY closed_at DESC LIMIT 1
-    )"};
-    return get.run_or(0);
+    return find_last_closed_window.run_or(0);
 }
 
 void set_window_root_tab (int64 window, int64 tab) {
     LOG("set_window_root_tab", window, tab);
     Transaction tr;
 
-    get_window_data(window)->root_tab = tab;
-    static State<>::Ment<int64, int64> set {R"(
-UPDATE windows SET root_tab = ? WHERE id = ?
-    )"};
-    set.run_void(tab, window);
-    window_updated(window);
+    auto data = get_window_data(window);
+    window_changing(window, data);
+    data->root_tab = tab;
+    window_changed(window, data, WINDOW_ROOT_TAB);
 }
 
 void set_window_focused_tab (int64 window, int64 tab) {
     LOG("set_window_focused_tab", window, tab);
     Transaction tr;
 
-    get_window_data(window)->focused_tab = tab;
-    static State<>::Ment<int64, int64> set {R"(
-UPDATE windows SET focused_tab = ? WHERE id = ?
-    )"};
-    set.run_void(tab, window);
+    auto data = get_window_data(window);
+    window_changing(window, data);
+    data->focused_tab = tab;
+    window_changed(window, data, WINDOW_FOCUSED_TAB);
     set_tab_visited(tab);
-    window_updated(window);
 }
 
 void set_window_closed_at (int64 window, optional<double> closed_at) {
     Transaction tr;
-    get_window_data(window)->closed_at = closed_at.value_or(0);
-    static State<>::Ment<optional<double>, int64> set {R"(
-UPDATE windows SET closed_at = ? WHERE id = ?
-    )"};
-    set.run_void(closed_at, window);
-    window_updated(window);
+    auto data = get_window_data(window);
+    window_changing(window, data);
+    data->closed_at = closed_at.value_or(0);
+    window_changed(window, data, WINDOW_CLOSED_AT);
 }
 
 void close_window (int64 window) {
@@ -573,40 +2319,981 @@ void unclose_window (int64 window) {
 
 ///// MISC
 
+static State<int64>::Ment<> find_orphans {R"(
+SELECT id FROM tabs a
+WHERE parent <> 0
+AND NOT EXISTS (SELECT 1 FROM tabs b WHERE b.id = a.parent)
+ORDER BY created_at
+)"};
 void fix_problems () {
     LOG("fix_problems");
     Transaction tr;
+    flush_changes();
 
-    suspend_child_counts = true;
+    suspend_aggregates = true;
 
-    State<int64>::Ment<> get_orphans {R"(
-SELECT id FROM tabs a
-WHERE parent <> 0
-AND NOT EXISTS (SELECT 1 FROM tabs b WHERE b.id = a.parent)
-ORDER BY created_at
-    )", true};
-    vector<int64> orphans = get_orphans.run();
+    vector<int64> orphans = find_orphans.run();
     if (!orphans.empty()) {
         int64 orphanage = create_tab(0, TabRelation::LAST_CHILD, "data:text/html,<title>Orphaned Tabs</title>", "Orphaned Tabs");
-        for (auto orphan : orphans) {
-            move_tab(orphan, orphanage, TabRelation::LAST_CHILD);
+        move_tabs(orphans, orphanage, TabRelation::LAST_CHILD);
+    }
+
+    suspend_aggregates = false;
+    rebuild_tab_aggregates();
+}
+
+
+#ifndef TAP_DISABLE_TESTS
+#include <filesystem>
+#include <random>
+
+#include "../tap/tap.h"
+#include "../util/alloc_count.h"
+#include "../util/files.h"
+
+ // Wraps the default VFS to count fsyncs, and optionally make them slow.  Must
+ // be called before init_db.
+static atomic<int64> syncs = 0;
+static double sync_delay = 0;
+static void count_syncs () {
+    static sqlite3_vfs* base = sqlite3_vfs_find(nullptr);
+     // Different kinds of files can have different methods
+    static map<const sqlite3_io_methods*, sqlite3_io_methods> wrapped_methods;
+    static map<const sqlite3_io_methods*, const sqlite3_io_methods*> base_methods;
+     // The writer thread opens files on its own connection
+    static std::mutex methods_mutex;
+    static sqlite3_vfs vfs = []{
+        sqlite3_vfs r = *base;
+        r.zName = "count_syncs";
+        r.xOpen = [](sqlite3_vfs*, const char* name, sqlite3_file* f, int flags, int* out_flags){
+            int rc = base->xOpen(base, name, f, flags, out_flags);
+            if (rc == SQLITE_OK && f->pMethods) {
+                std::lock_guard lock (methods_mutex);
+                auto [iter, added] = wrapped_methods.emplace(f->pMethods, *f->pMethods);
+                if (added) {
+                    iter->second.xSync = [](sqlite3_file* f, int flags){
+                        syncs += 1;
+                        if (sync_delay) this_thread::sleep_for(duration<double>(sync_delay));
+                        const sqlite3_io_methods* methods;
+                        {
+                            std::lock_guard lock (methods_mutex);
+                            methods = base_methods[f->pMethods];
+                        }
+                        return methods->xSync(f, flags);
+                    };
+                    base_methods.emplace(&iter->second, iter->first);
+                }
+                f->pMethods = &iter->second;
+            }
+            return rc;
+        };
+        return r;
+    }();
+    AS(db, sqlite3_vfs_register(&vfs, 1));
+}
+
+static void init_test_db (const StorageProfile& profile = StorageProfile()) {
+    String folder = exe_relative("test"sv);
+    if (!logstream) {
+        filesystem::create_directories(folder);
+        init_log(folder + "/model-data.log"sv);
+    }
+    String db_file = folder + "/model-data.sqlite"sv;
+     // Including the WAL, which would otherwise be applied to the new file
+    for (auto suffix : {"", "-wal", "-shm"}) filesystem::remove(db_file + suffix);
+    init_db(db_file, profile);
+}
+
+ // For benchmarks that count fsyncs.  The default only fsyncs at checkpoints.
+static StorageProfile sync_every_commit () {
+    StorageProfile r;
+    r.synchronous = 2;
+    return r;
+}
+
+ // Compares cached and stored aggregates with ones recalculated the slow way
+static bool aggregates_ok () {
+    String sql = "SELECT id";
+    for (auto& agg : aggregates) sql += ", "s + agg.column;
+    sql += " FROM tabs";
+    Statement get (sql.c_str(), true);
+    map<int64, AggregateDelta> stored;
+    for (get.step(); !get.done(); get.step()) {
+        auto& st = stored[get.read_column<int64>(0)];
+        for (size_t i = 0; i < n_aggregates; i++) {
+            st.diffs[i] = get.read_column<int64>(1 + int(i));
+        }
+    }
+    get.reset();
+
+    map<int64, AggregateDelta> expected;
+    for (auto& [id, _] : stored) {
+        auto data = get_tab_data(id);
+        if (data->closed_at) continue;
+        for (int64 p = data->parent; p > 0; p = get_tab_data(p)->parent) {
+            for (size_t i = 0; i < n_aggregates; i++) {
+                expected[p].diffs[i] += aggregates[i].counts(*data);
+            }
+            if (get_tab_data(p)->closed_at) break;
+        }
+    }
+    for (auto& [id, st] : stored) {
+        auto data = get_tab_data(id);
+        for (size_t i = 0; i < n_aggregates; i++) {
+            int64 e = expected[id].diffs[i];
+            if (st.diffs[i] != e || data->*aggregates[i].total != e) {
+                tap::diag("Wrong "s + aggregates[i].column + " for " + std::to_string(id));
+                return false;
+            }
         }
     }
+    return true;
+}
 
-    tabs_by_id.clear();
-    State<>::Ment<> fix_child_counts {R"(
-WITH RECURSIVE ancestors (child, ancestor) AS (
-    SELECT id, parent FROM tabs WHERE closed_at IS NULL
-    UNION ALL
-    SELECT id, ancestor FROM tabs, ancestors
-        WHERE closed_at IS NULL AND parent = child
-)
-UPDATE tabs SET child_count = (
-    SELECT count(*) from ancestors where ancestor = id
-)
+static void data_tests () {
+    using namespace tap;
+    init_test_db();
+
+    int64 a = create_tab(0, TabRelation::LAST_CHILD, "about:blank");
+    int64 b = create_tab(0, TabRelation::LAST_CHILD, "about:blank");
+    int64 c = create_tab(b, TabRelation::BEFORE, "about:blank");
+    int64 d = create_tab(0, TabRelation::FIRST_CHILD, "about:blank");
+    int64 e = create_tab(b, TabRelation::AFTER, "about:blank");
+    is(get_all_children(0), vector<int64>{d, a, c, b, e}, "Children are ordered by position");
+
+    State<int64>::Ment<int64> get_children_sql {R"(
+SELECT id FROM tabs WHERE parent = ? ORDER BY position
+    )", true};
+    is(get_all_children(0), get_children_sql.run(0), "Index agrees with database");
+
+    close_tab(c);
+    is(get_all_unclosed_children(0), vector<int64>{d, a, b, e}, "Closed tabs are skipped");
+    is(get_next_unclosed_tab(a), b, "get_next_unclosed_tab skips closed tabs");
+    is(get_prev_unclosed_tab(b), a, "get_prev_unclosed_tab skips closed tabs");
+    is(get_prev_unclosed_tab(c), a, "get_prev_unclosed_tab works from a closed tab");
+    is(get_prev_unclosed_tab(d), 0, "get_prev_unclosed_tab returns 0 at start");
+    is(get_next_unclosed_tab(e), 0, "get_next_unclosed_tab returns 0 at end");
+    unclose_tab(c);
+    is(get_next_unclosed_tab(a), c, "Unclosed tab is found again");
+
+    move_tab(a, e, TabRelation::LAST_CHILD);
+    is(get_all_children(0), vector<int64>{d, c, b, e}, "Moved tab leaves old parent");
+    is(get_all_children(e), vector<int64>{a}, "Moved tab joins new parent");
+    is(get_tab_data(e)->child_count, 1, "Child count updated by move");
+
+    try {
+        Transaction tr;
+        move_tab(d, e, TabRelation::LAST_CHILD);
+        throw std::runtime_error("rollback");
+    }
+    catch (std::exception&) { }
+    is(get_all_children(0), vector<int64>{d, c, b, e}, "Index is restored after rollback");
+    is(get_all_children(e), vector<int64>{a}, "Index is restored after rollback (new parent)");
+
+    close_tab(e);
+    delete_tab_and_children(e);
+    is(get_all_children(0), vector<int64>{d, c, b}, "Deleted tab is removed from index");
+    is(get_all_children(e), vector<int64>{}, "Deleted tab's children are removed from index");
+    is(get_all_children(0), get_children_sql.run(0), "Index still agrees with database");
+    throws<Error>([=]{ get_tab_data(e + 1000000); }, "get_tab_data throws for a missing tab");
+    ok(!tabs_by_id.count(e + 1000000), "Missing tabs aren't cached");
+    throws<Error>([]{ get_window_data(1000000); }, "get_window_data throws for a missing window");
+    ok(!windows_by_id.count(1000000), "Missing windows aren't cached");
+
+    vector<NewTab> new_tabs (2000, NewTab{"about:blank"});
+    vector<int64> created = create_tabs(b, TabRelation::LAST_CHILD, new_tabs);
+    is(created.size(), size_t(2000), "create_tabs creates all tabs");
+    is(get_all_children(b), created, "create_tabs creates tabs in order");
+    is(get_tab_data(b)->child_count, 2000, "create_tabs updates child count");
+    size_t longest = 0;
+    for (int64 id : created) {
+        if (get_tab_data(id)->position.size > longest) {
+            longest = get_tab_data(id)->position.size;
+        }
+    }
+    ok(longest <= 2, "create_tabs makes short positions");
+    int64 before = create_tabs(created[1000], TabRelation::BEFORE, span<const NewTab>(new_tabs).subspan(0, 3))[2];
+    is(get_next_unclosed_tab(before), created[1000], "create_tabs works with BEFORE");
+    is(get_all_children(b), get_children_sql.run(b), "create_tabs agrees with database");
+    ok(aggregates_ok(), "Aggregates are correct after create_tabs");
+
+    int64 f = created[10];
+    vector<int64> grandchildren = create_tabs(f, TabRelation::LAST_CHILD, new_tabs);
+    create_tabs(grandchildren[0], TabRelation::LAST_CHILD, span<const NewTab>(new_tabs).subspan(0, 5));
+    close_tab(grandchildren[1]);
+    is(get_subtree(f).size(), size_t(2006), "get_subtree finds all descendants");
+    close_tab_and_children(f);
+    ok(get_tab_data(grandchildren[3])->closed_at, "close_tab_and_children closes descendants");
+    is(get_all_unclosed_children(f), vector<int64>{}, "close_tab_and_children closes all children");
+    ok(aggregates_ok(), "Aggregates are correct after close_tab_and_children");
+    unclose_tab_and_children(f);
+    is(get_all_unclosed_children(f).size(), size_t(1999), "unclose_tab_and_children uncloses children");
+    ok(get_tab_data(grandchildren[1])->closed_at, "unclose_tab_and_children skips previously closed tabs");
+    ok(aggregates_ok(), "Aggregates are correct after unclose_tab_and_children");
+
+    close_tab_with_heritage(f);
+    is(get_next_unclosed_tab(f), grandchildren[0], "Heir takes the place of closed tab");
+    is(get_all_children(grandchildren[0]).size(), size_t(5 + 1998), "Heir inherits siblings");
+    is(get_all_children(f), vector<int64>{grandchildren[1]}, "Closed children are not inherited");
+    ok(aggregates_ok(), "Aggregates are correct after close_tab_with_heritage");
+
+    delete_tab_and_children(grandchildren[0]);
+    ok(get_tab_data(grandchildren[5])->deleted, "delete_tab_and_children marks descendants deleted");
+    State<int64>::Ment<> count_tabs {"SELECT count(*) FROM tabs", true};
+    is(count_tabs.run_single(), int64(3 + 2003 + 1), "delete_tab_and_children deletes descendants");
+    ok(aggregates_ok(), "Aggregates are correct after delete_tab_and_children");
+
+    int64 g = create_tab(b, TabRelation::LAST_CHILD, "about:blank");
+    int64 h = create_tab(g, TabRelation::LAST_CHILD, "about:blank");
+    int64 unvisited = get_tab_data(b)->unvisited_count;
+    set_tab_visited(h);
+    is(get_tab_data(b)->unvisited_count, unvisited - 1, "Visiting a tab updates unvisited_count");
+    star_tab(h);
+    is(get_tab_data(g)->starred_count, 1, "Starring a tab updates starred_count");
+    close_tab(g);
+    is(get_tab_data(b)->starred_count, 0, "Closed tabs hide their descendants' stars");
+    is(get_tab_data(g)->starred_count, 1, "Closed tabs keep their own totals");
+    ok(aggregates_ok(), "Aggregates are correct after visiting and starring");
+    State<>::Ment<> break_counts {"UPDATE tabs SET child_count = 7, starred_count = 3", true};
+    break_counts.run_void();
+    auto held = get_tab_data(b);
+    rebuild_tab_aggregates();
+    ok(aggregates_ok(), "rebuild_tab_aggregates fixes broken aggregates");
+    is(held, get_tab_data(b), "rebuild_tab_aggregates keeps cached rows where they are");
+    is(held->starred_count, 0, "rebuild_tab_aggregates updates cached rows");
+
+    State<int64>::Ment<int64> get_last_visited_sql {R"(
+SELECT id FROM tabs WHERE closed_at IS NULL AND visited_at IS NOT NULL
+ORDER BY visited_at DESC LIMIT ?
+    )", true};
+    for (size_t i = 0; i < 10; i++) set_tab_visited(created[100 + i]);
+    flush_relaxed_changes();
+    is(get_last_visited_tabs(5), get_last_visited_sql.run(5), "get_last_visited_tabs agrees with database");
+    set_tab_visited(created[100]);
+    set_tab_visited(created[200]);
+    uint64 statements_before = statements_run;
+    vector<int64> last_visited = get_last_visited_tabs(4);
+    is(uint64(statements_run), statements_before, "get_last_visited_tabs doesn't query when it doesn't need to");
+    is(last_visited, vector<int64>{created[200], created[100], created[109], created[108]},
+        "get_last_visited_tabs puts newly visited tabs first");
+    close_tab(created[109]);
+    is(get_last_visited_tabs(3), vector<int64>{created[200], created[100], created[108]},
+        "get_last_visited_tabs skips closed tabs");
+    unclose_tab(created[109]);
+    is(get_last_visited_tabs(3), vector<int64>{created[200], created[100], created[109]},
+        "get_last_visited_tabs finds unclosed tabs again");
+    flush_relaxed_changes();
+    is(get_last_visited_tabs(8), get_last_visited_sql.run(8), "get_last_visited_tabs agrees with database again");
+    vector<int64> all_visited = get_last_visited_tabs(1000);
+    is(all_visited, get_last_visited_sql.run(1000), "get_last_visited_tabs leaves out unvisited tabs like the database");
+    statements_before = statements_run;
+    is(get_last_visited_tabs(2000), all_visited, "get_last_visited_tabs remembers when it has every visited tab");
+    is(uint64(statements_run), statements_before, "get_last_visited_tabs doesn't query again after a short result");
+
+    struct TestObserver : Observer {
+        vector<int64> tabs;
+        TestObserver* victim = nullptr;
+        TestObserver (bool selective) : Observer(selective) { }
+        void Observer_after_commit (const vector<int64>& updated_tabs, const vector<int64>&) override {
+            tabs = updated_tabs;
+            if (victim) {
+                delete victim;
+                victim = nullptr;
+            }
+        }
+    };
+    {
+        TestObserver everything (false);
+        TestObserver some (true);
+        observe_tab(&some, b, 2);
+        int64 gc = create_tab(created[500], TabRelation::LAST_CHILD, "about:blank");
+        set_tab_title(created[500], "Child");
+        is(some.tabs, vector<int64>{created[500]}, "Selective observer gets children of observed tab");
+        set_tab_title(gc, "Grandchild");
+        is(some.tabs, vector<int64>{gc}, "Selective observer gets grandchildren of observed tab");
+        set_tab_title(d, "Unrelated");
+        is(some.tabs, vector<int64>{}, "Selective observer doesn't get unrelated tabs");
+        is(everything.tabs, vector<int64>{d}, "Non-selective observer gets everything");
+        observe_tab(&some, 0, 1);
+        {
+            Transaction tr;
+            set_tab_title(d, "Related");
+            set_tab_title(created[501], "Child");
+        }
+        is(some.tabs, vector<int64>{d, created[501]}, "Observing more tabs adds to updates");
+        unobserve_tab(&some, b, 2);
+        set_tab_title(created[501], "Child again");
+        is(some.tabs, vector<int64>{}, "unobserve_tab stops updates");
+
+        everything.victim = new TestObserver(true);
+        set_tab_title(d, "Deleting");
+        pass("Observer deleted by another observer isn't called");
+    }
+
+    State<String, String, String, double>::Ment<int64> get_tab_sql {R"(
+SELECT url, title, favicon, visited_at FROM tabs WHERE id = ?
     )", true};
-    fix_child_counts.run_void();
+    State<int64>::Ment<int64> get_focused_sql {R"(
+SELECT focused_tab FROM windows WHERE id = ?
+    )", true};
+    int64 w = create_window(0, b);
+    get_window_data(w);
+    {
+        Transaction tr;
+        set_tab_url(d, "https://example.com/");
+        set_tab_title(d, "Example 1");
+        set_tab_title(d, "Example 2");
+        set_tab_favicon(d, "https://example.com/favicon.ico");
+        set_window_focused_tab(w, d);
+    }
+    auto [url, title, favicon, visited_at] = get_tab_sql.run_single(d);
+    is(title, "Example 2"s, "Deferred writes are flushed at commit");
+    is(url, "https://example.com/"s, "All deferred fields are flushed");
+    is(visited_at, get_tab_data(d)->visited_at, "Deferred visited_at is flushed");
+    is(get_focused_sql.run_single(w), d, "Deferred window fields are flushed");
+    is(last_transaction_stats().tabs_written, uint64(1), "One UPDATE per dirty tab");
+    is(last_transaction_stats().windows_written, uint64(1), "One UPDATE per dirty window");
+    is(last_transaction_stats().statements, uint64(4), "Statement count includes BEGIN and COMMIT");
+    try {
+        Transaction tr;
+        set_tab_title(d, "Example 3");
+        throw std::runtime_error("rollback");
+    }
+    catch (std::exception&) { }
+    is(get_tab_data(d)->title, "Example 2"s, "Deferred writes are discarded on rollback");
+
+    set_tab_title(d, "Example 4");
+    is(last_transaction_stats().tabs_written, uint64(0), "Relaxed fields aren't written at commit");
+    is(std::get<1>(get_tab_sql.run_single(d)), "Example 2"s, "Relaxed field isn't in database yet");
+    try {
+        Transaction tr;
+        set_tab_title(d, "Rolled back");
+        throw std::runtime_error("rollback");
+    }
+    catch (std::exception&) { }
+    is(get_tab_data(d)->title, "Example 4"s, "Relaxed changes from earlier transactions survive a rollback");
+    {
+        Transaction tr;
+        is(saved_dirty_tabs.size(), size_t(0), "Starting a transaction doesn't copy dirty rows");
+    }
+    try {
+        Transaction tr;
+        flush_changes();
+        set_tab_title(b, "Rolled back");
+        throw std::runtime_error("rollback");
+    }
+    catch (std::exception&) { }
+    is(get_tab_data(d)->title, "Example 4"s, "Relaxed changes written by a rolled back transaction survive");
+    try {
+        Transaction tr;
+        set_tab_title(b, "Rolled back");
+        throw std::runtime_error("rollback");
+    }
+    catch (std::exception&) { }
+    is(get_tab_data(d)->title, "Example 4"s, "Relaxed changes a rollback didn't touch survive");
+    flush_relaxed_changes();
+    is(std::get<1>(get_tab_sql.run_single(d)), "Example 4"s, "flush_relaxed_changes writes relaxed fields");
+    set_tab_title(d, "Example 5");
+    star_tab(d);
+    is(std::get<1>(get_tab_sql.run_single(d)), "Example 5"s, "Relaxed fields are written along with strict ones");
+    set_relaxed_fields(TAB_TITLE, 0, 0);
+    set_tab_title(d, "Example 6");
+    is(std::get<1>(get_tab_sql.run_single(d)), "Example 6"s, "Relaxed fields are written after max_delay");
+
+
+    uint64 v0 = current_version();
+    set_tab_title(d, "Feed 1");
+    is(current_version(), v0 + 1, "Each commit gets a version");
+    star_tab(d);
+    set_window_focused_tab(w, b);
+    try {
+        Transaction tr;
+        set_tab_title(b, "Feed rollback");
+        throw std::runtime_error("rollback");
+    }
+    catch (std::exception&) { }
+    is(current_version(), v0 + 3, "Rolled back transactions don't get versions");
+    Changes changes = changes_since(v0);
+    ok(changes.complete, "changes_since is complete");
+    is(changes.version, v0 + 3, "changes_since gives the current version");
+     // Focusing a tab visits it
+    ok(changes.tabs == vector<pair<int64, uint32>>{
+        {b, TAB_VISITED_AT}, {d, TAB_TITLE | TAB_STARRED_AT}
+    }, "changes_since merges tab changes");
+    ok(changes.windows == vector<pair<int64, uint32>>{{w, WINDOW_FOCUSED_TAB}},
+        "changes_since includes window changes");
+    ok(changes_since(v0 + 3).tabs.empty(), "No changes since current version");
+     // The last commit changed one tab and one window
+    set_change_log_limit(2);
+    ok(!changes_since(v0).complete, "changes_since is incomplete past the log limit");
+    ok(changes_since(v0 + 2).complete, "changes_since is complete within the log limit");
+    set_change_log_limit(100000);
+
+    set_relaxed_fields(0, 0, 0);
+    set_group_commit_window(1000);
+    uint64 v1 = current_version();
+    set_tab_title(d, "Group 1");
+    ok(group_commit_pending(), "Transaction waits for group commit");
+    is(current_version(), v1 + 1, "Transaction in group still commits logically");
+    try {
+        Transaction tr;
+        set_tab_title(d, "Group rollback");
+        throw std::runtime_error("rollback");
+    }
+    catch (std::exception&) { }
+    is(std::get<1>(get_tab_sql.run_single(d)), "Group 1"s, "Rollback in group keeps earlier transactions");
+    set_tab_title(b, "Group 2");
+    flush_group_commit();
+    ok(!group_commit_pending(), "flush_group_commit commits the group");
+    ok(sqlite3_get_autocommit(db), "No SQLite transaction is left open");
+    is(std::get<1>(get_tab_sql.run_single(b)), "Group 2"s, "Group was committed");
+    set_group_commit_window(0);
+    set_tab_title(b, "Group 3");
+    ok(!group_commit_pending(), "Window of 0 commits every transaction");
+
+    uint64 prepares_before = late_prepares;
+    int64 last_closed = get_last_closed_tab();
+    get_all_unclosed_windows();
+    get_last_closed_window();
+    fix_problems();
+     // 70 rows is a full chunk and a few smaller ones
+    int64 bulk_parent = create_tab(0, TabRelation::LAST_CHILD, "about:blank");
+    create_tabs(bulk_parent, TabRelation::LAST_CHILD, vector<NewTab>(70, NewTab{"about:blank"}));
+    is(get_children_sql.run(bulk_parent).size(), size_t(70), "create_tabs inserts every row");
+    {
+         // A combination of dirty fields that hasn't been written before
+        Transaction tr;
+        set_tab_favicon(bulk_parent, "about:blank");
+        set_tab_title(bulk_parent, "Bulk");
+        star_tab(bulk_parent);
+    }
+    is(uint64(late_prepares), prepares_before, "Model statements were prepared at startup");
+
+    State<int64>::Ment<> count_invalid_positions {
+        "SELECT COUNT(*) FROM tabs WHERE NOT bifractor_valid(position)", true
+    };
+    is(count_invalid_positions.run_single(), int64(0), "Bifractor SQL functions work on the model's database");
+
+    sqlite3* old_db = db;
+    sqlite3* new_db;
+    AS(new_db, sqlite3_open(sqlite3_db_filename(db, "main"), &new_db));
+    rebind_statements(new_db);
+    is(db, new_db, "rebind_statements switches connections");
+    is(get_last_closed_tab(), last_closed, "Statements work after rebind_statements");
+    set_tab_title(b, "Rebound");
+    is(late_prepares - prepares_before, uint64(0), "rebind_statements prepares everything again");
+     // The test's own transient statements still use the old connection
+    sqlite3_close_v2(old_db);
+
+    {
+        Statement registered {"SELECT 1"};
+        prepare_statements(true);
+        doesnt_throw([]{ finish_preparing(); }, "Statements can be prepared in the background");
+        ok(registered.handle.load(), "Background preparing gets registered statements");
+    }
+    {
+        Statement broken {"SELECT nonsense FROM nowhere"};
+        prepare_statements(true);
+        bool threw = false;
+        try { finish_preparing(); }
+        catch (Error&) { threw = true; }
+        ok(threw, "finish_preparing throws what the background thread threw");
+    }
+
+    State<int64>::Ment<int64> children_sql {"SELECT id FROM tabs WHERE parent = ? ORDER BY position", true};
+    vector<int64> streamed;
+    for (int64 t : children_sql.iterate(0)) streamed.push_back(t);
+    is(streamed, children_sql.run(0), "iterate gets the same rows as run");
+    for (int64 t : children_sql.iterate(0)) {
+        if (t) break;
+    }
+    is(children_sql.run(0), streamed, "Breaking out of iterate resets the statement");
+    try {
+        for (int64 t : children_sql.iterate(0)) {
+            if (t) throw std::runtime_error("stop");
+        }
+    }
+    catch (std::exception&) { }
+    is(children_sql.run(0), streamed, "Throwing out of iterate resets the statement");
+
+    int64 doomed = create_tab(0, TabRelation::LAST_CHILD, "about:blank", "Doomed");
+    create_tabs(doomed, TabRelation::LAST_CHILD, vector<NewTab>(3, NewTab{"about:blank"}));
+    close_tab(doomed);
+    prune_closed_tabs(0, -1);
+    is(get_last_closed_tab(), int64(0), "prune_closed_tabs deletes closed subtrees");
+    ok(aggregates_ok(), "Aggregates are fine after pruning");
+
+    int64 arena_parent = create_tab(0, TabRelation::LAST_CHILD, "about:blank");
+    int64 x = create_tab(arena_parent, TabRelation::LAST_CHILD, "about:blank");
+    int64 y = create_tab(arena_parent, TabRelation::LAST_CHILD, "about:blank");
+    uint8 long_bytes [21];
+    memset(long_bytes, 0x80, 20);
+    long_bytes[20] = 2;
+    move_tab(x, arena_parent, Bifractor(long_bytes, 21));
+    long_bytes[20] = 1;
+    index_arena_limit = 0;
+    move_tab(y, arena_parent, Bifractor(long_bytes, 21));
+    is(get_all_children(arena_parent), vector<int64>{y, x}, "Index is right after compacting its arena");
+    is(index_arena_limit, min_index_arena_limit, "Compacting resets the arena limit");
+
+     // Drag a bunch of tabs into the same gap, which makes positions grow
+    struct CountingObserver : Observer {
+        size_t commits = 0;
+        size_t most_tabs = 0;
+        CountingObserver () : Observer(false) { }
+        void Observer_after_commit (const vector<int64>& updated_tabs, const vector<int64>&) override {
+            commits += 1;
+            most_tabs = max(most_tabs, updated_tabs.size());
+        }
+    };
+    set_rekey_threshold(4);
+    int64 drag_parent = create_tab(0, TabRelation::LAST_CHILD, "about:blank");
+    vector<int64> dragged = create_tabs(
+        drag_parent, TabRelation::LAST_CHILD, vector<NewTab>(50, NewTab{"about:blank"})
+    );
+    vector<int64> expected_order = dragged;
+    {
+        CountingObserver counter;
+        for (size_t i = 0; i < 24; i++) {
+            move_tab(dragged[i], dragged[25], TabRelation::BEFORE);
+            expected_order.erase(find(expected_order.begin(), expected_order.end(), dragged[i]));
+            expected_order.insert(find(expected_order.begin(), expected_order.end(), dragged[25]), dragged[i]);
+        }
+        is(counter.commits, size_t(24), "Rekeying happens in the same commit as the move");
+        ok(counter.most_tabs > 2, "Observers get all the rekeyed siblings at once");
+        ok(counter.most_tabs < dragged.size() / 2, "Rekeying only touches the siblings near the long position");
+    }
+    is(get_all_children(drag_parent), expected_order, "Rekeying keeps the order");
+    is(get_all_children(drag_parent), get_children_sql.run(drag_parent), "Rekeying agrees with database");
+    bool all_short = true;
+    for (int64 t : dragged) {
+        if (get_tab_data(t)->position.size > 4) all_short = false;
+    }
+    ok(all_short, "Positions are rekeyed when they get too long");
+    State<int64>::Ment<int64> count_long_positions {
+        "SELECT COUNT(*) FROM tabs WHERE parent = ? AND length(position) > 4"
+    };
+    is(count_long_positions.run_single(drag_parent), int64(0), "Rekeyed positions are in the database");
+    rekey_children(drag_parent);
+    is(get_all_children(drag_parent), expected_order, "Rekeying when it isn't needed is harmless");
+    ok(aggregates_ok(), "Aggregates are fine after rekeying");
+    set_rekey_threshold(Bifractor::inline_capacity);
+
+    done_testing();
+}
+static tap::TestSet tests ("model/data", &data_tests);
+
+static void data_bench () {
+    using namespace tap;
+    init_test_db();
+
+    State<>::Ment<int64, Bifractor, double> insert {R"(
+INSERT INTO tabs (parent, position, url_hash, url, title, created_at)
+VALUES (?, ?, 0, 'about:blank', '', ?)
+    )", true};
+    State<int64>::Ment<int64, Bifractor> get_next_sql {R"(
+SELECT id FROM tabs WHERE parent = ? AND position > ? AND closed_at IS NULL ORDER BY position ASC LIMIT 1
+    )", true};
+    State<int64>::Ment<int64> get_children_sql {R"(
+SELECT id FROM tabs WHERE parent = ? ORDER BY position
+    )", true};
+
+     // Tabs are inserted in families of 100 siblings
+    int64 n_tabs = 0;
+    for (int64 target : {10000, 100000, 1000000}) {
+        {
+            Transaction tr;
+            Bifractor position {0};
+            for (; n_tabs < target; n_tabs++) {
+                int64 parent = n_tabs < 100 ? 0 : n_tabs / 100;
+                if (n_tabs % 100 == 0) position = Bifractor(0);
+                position = Bifractor(position, Bifractor(1), 1/32.0);
+                insert.run_void(parent, position, 0);
+            }
+        }
+        auto start = steady_clock::now();
+        load_tab_index();
+        double load_time = duration<double>(steady_clock::now() - start).count();
+
+        constexpr int n_ops = 10000;
+        minstd_rand rng;
+        vector<int64> ids;
+        for (int i = 0; i < n_ops; i++) {
+            ids.push_back(1 + rng() % n_tabs);
+        }
+        for (int64 id : ids) get_tab_data(id);
+
+        start = steady_clock::now();
+        int64 sql_sum = 0;
+        for (int64 id : ids) {
+            auto data = get_tab_data(id);
+            sql_sum += get_next_sql.run_or(data->parent, data->position, 0);
+            sql_sum += get_children_sql.run(id).size();
+        }
+        double sql_time = duration<double>(steady_clock::now() - start).count();
+
+        start = steady_clock::now();
+        int64 index_sum = 0;
+        for (int64 id : ids) {
+            auto data = get_tab_data(id);
+            index_sum += index_next_unclosed(data->parent, data->position);
+            auto iter = children_by_parent.find(id);
+            if (iter != children_by_parent.end()) index_sum += iter->second.all.size();
+        }
+        double index_time = duration<double>(steady_clock::now() - start).count();
 
-    suspend_child_counts = false;
+        is(index_sum, sql_sum, std::to_string(n_tabs) + " tabs: index gives same results as SQL");
+        diag(std::to_string(n_tabs) + " tabs: load " + std::to_string(load_time * 1000) + "ms, "
+            + "sql " + std::to_string(sql_time / n_ops * 1e6) + "us/op, "
+            + "index " + std::to_string(index_time / n_ops * 1e6) + "us/op"
+        );
+    }
+    done_testing();
+}
+static tap::TestSet bench ("model/data/bench/index", &data_bench);
+
+static void writer_tests () {
+    using namespace tap;
+    count_syncs();
+    init_test_db(sync_every_commit());
+     // Make every transaction commit, on a slow disk
+    set_relaxed_fields(0, 0, 0);
+    sync_delay = 0.005;
+
+    vector<int64> tabs = create_tabs(0, TabRelation::LAST_CHILD, vector<NewTab>(20, NewTab{"about:blank"}));
+    int64 w = create_window(0, tabs[0]);
+
+     // How long each operation keeps the calling thread busy.  Closing a tab
+     // reads the database after writing (to prune and refocus windows), and
+     // so does get_all_unclosed_windows right after the others.
+    auto run_ops = [&](Str name){
+        constexpr int n_ops = 60;
+        double total = 0;
+        double worst = 0;
+        double reads = 0;
+        int64 created = 0;
+        for (int i = 0; i < n_ops; i++) {
+            auto start = steady_clock::now();
+            switch (i % 5) {
+                case 0: created = create_tab(tabs[i % 20], TabRelation::LAST_CHILD, "about:blank", name); break;
+                case 1: set_tab_title(tabs[i % 20], std::to_string(i)); break;
+                case 2: set_window_focused_tab(w, tabs[i % 20]); break;
+                case 3: close_tab(created); break;
+                case 4: get_all_unclosed_windows(); break;
+            }
+            double time = duration<double>(steady_clock::now() - start).count();
+            total += time;
+            worst = max(worst, time);
+            if (i % 5 == 4) reads += time;
+        }
+        diag(String(name) + ": " + std::to_string(total / n_ops * 1e6) + "us/op average, "
+            + std::to_string(worst * 1e6) + "us/op worst, "
+            + std::to_string(reads / (n_ops / 5) * 1e6) + "us/read after writes"
+        );
+        return total / n_ops;
+    };
+    double direct_time = run_ops("direct");
+
+    start_writer_thread();
+    int64 start_syncs = syncs;
+    double queued_time = run_ops("writer thread");
+    ok(queued_time < direct_time / 5, "Writer thread keeps fsyncs off the calling thread");
+    doesnt_throw([]{ committed_to_disk().get(); }, "Everything gets committed");
+    ok(syncs > start_syncs, "Writer thread did fsync");
+
+     // Reads see queued writes
+    int64 a = create_tab(0, TabRelation::LAST_CHILD, "about:blank", "A");
+    set_tab_title(a, "Queued");
+    static State<String>::Ment<int64> get_title {"SELECT title FROM tabs WHERE id = ?"};
+    is(get_title.run_single(a), "Queued"s, "Reading the database waits for queued writes");
+    close_tab(a);
+    is(get_last_closed_tab(), a, "Queries see queued closes");
+
+     // Ids still line up with the database after a rollback
+    String committed_title = get_tab_data(tabs[0])->title;
+    int64 b = 0;
+    try {
+        Transaction tr;
+        b = create_tab(0, TabRelation::LAST_CHILD, "about:blank", "B");
+        set_tab_title(tabs[0], "Rolled back");
+        throw std::runtime_error("rollback");
+    }
+    catch (...) { }
+    is(get_tab_data(tabs[0])->title, committed_title, "Rollback works with the writer thread");
+    int64 c = create_tab(0, TabRelation::LAST_CHILD, "about:blank", "C");
+    is(c, b, "Rolled back id is reused");
+    is(get_title.run_single(c), "C"s, "New tab has the right data");
+
+     // A failing write shows up in committed_to_disk
+    {
+        Transaction tr;
+        set_tab_title(c, "Never written");
+        static State<>::Ment<int64> bad {"INSERT INTO tabs (id) VALUES (?)"};
+        run_write(bad, a);
+    }
+    throws<Error>([]{ committed_to_disk().get(); }, "Failed write is reported");
+    throws<Error>([]{ get_last_closed_tab(); }, "Next read throws the error too");
+    is(get_tab_data(c)->title, "C"s, "Cache forgets the transaction that failed");
+    doesnt_throw([]{ get_last_closed_tab(); }, "But only once");
+
+     // Caught inside a transaction, the error still rolls it back
+    try {
+        Transaction tr;
+        set_tab_title(c, "Also never written");
+        static State<>::Ment<int64> bad {"INSERT INTO tabs (id) VALUES (?)"};
+        run_write(bad, a);
+        try { get_last_closed_tab(); }
+        catch (std::exception&) { }
+    }
+    catch (std::exception&) { }
+    is(get_tab_data(c)->title, "C"s, "A failed write rolls back its transaction even if caught");
+    is(get_title.run_single(c), "C"s, "And the database agrees");
+
+     // A failed write in a group only loses its own transaction
+    set_group_commit_window(60);
+     // Nothing reads the database until the failed write is checked for, so
+     // the error isn't thrown until then.
+    for (int i = 1; i <= 3; i++) get_tab_data(tabs[i]);
+    set_tab_title(tabs[1], "Before");
+    {
+        Transaction tr;
+        set_tab_title(tabs[2], "Failed");
+        static State<>::Ment<int64> bad {"INSERT INTO tabs (id) VALUES (?)"};
+        run_write(bad, a);
+    }
+    set_tab_title(tabs[3], "After");
+    throws<Error>([]{ get_last_closed_tab(); }, "Failed write in a group is thrown by the next read");
+    try {
+        Transaction tr;
+        set_tab_title(tabs[4], "Rolled back");
+        throw std::runtime_error("rollback");
+    }
+    catch (...) { }
+    set_tab_title(tabs[5], "After rollback");
+    flush_group_commit();
+    throws<Error>([]{ committed_to_disk().get(); }, "And reported by committed_to_disk");
+    is(get_title.run_single(tabs[1]), "Before"s, "Transaction before the failed one is kept");
+    isnt(get_title.run_single(tabs[2]), "Failed"s, "Failed transaction is rolled back");
+    is(get_title.run_single(tabs[3]), "After"s, "Transaction after the failed one is kept");
+    isnt(get_title.run_single(tabs[4]), "Rolled back"s, "Rollbacks in the same group still work");
+    is(get_title.run_single(tabs[5]), "After rollback"s, "And so do transactions after them");
+    is(get_tab_data(tabs[2])->title, get_title.run_single(tabs[2]), "Cache agrees with the database");
+     // A rollback empties the cache, so the rows written earlier in the group
+     // can't be read from what's committed until the group is.
+    set_tab_title(tabs[6], "Grouped");
+    try {
+        Transaction tr;
+        set_tab_title(tabs[7], "Rolled back");
+        throw std::runtime_error("rollback");
+    }
+    catch (...) { }
+    is(get_tab_data(tabs[6])->title, "Grouped"s, "Rows dropped from the cache are read with the group's writes");
+    set_group_commit_window(0);
+
+    doesnt_throw([]{ stop_writer_thread(); }, "stop_writer_thread");
+    sync_delay = 0;
+    is(get_title.run_single(c), "C"s, "Database is fine after stopping the writer thread");
+    ok(aggregates_ok(), "Aggregates are fine");
+    done_testing();
+}
+static tap::TestSet writing ("model/data/writer", &writer_tests);
+
+static void group_commit_bench () {
+    using namespace tap;
+    count_syncs();
+    init_test_db(sync_every_commit());
+    set_relaxed_fields(0, 0, 0);
+
+    vector<int64> tabs = create_tabs(0, TabRelation::LAST_CHILD, vector<NewTab>(30, NewTab{"about:blank"}));
+
+     // Simulates a bunch of tabs finishing loading at once
+    auto burst = [&](double window){
+        set_group_commit_window(window);
+        constexpr int n_ops = 600;
+        int64 start_syncs = syncs;
+        auto start = steady_clock::now();
+        for (int i = 0; i < n_ops; i++) {
+            int64 tab = tabs[i % tabs.size()];
+            if (i % 2) set_tab_title(tab, std::to_string(i));
+            else set_tab_favicon(tab, std::to_string(i));
+        }
+        flush_group_commit();
+        double time = duration<double>(steady_clock::now() - start).count();
+        double n_syncs = double(syncs - start_syncs);
+        diag("window " + std::to_string(window * 1000) + "ms: "
+            + std::to_string(n_ops / time) + " commits/s, "
+            + std::to_string(n_syncs / time) + " fsyncs/s, "
+            + std::to_string(n_syncs / n_ops) + " fsyncs/commit"
+        );
+        return n_syncs;
+    };
+    double separate_syncs = burst(0);
+    burst(0.001);
+    double grouped_syncs = burst(0.005);
+    burst(0.02);
+    ok(grouped_syncs < separate_syncs / 2, "Group commit saves fsyncs");
+    done_testing();
+}
+static tap::TestSet group_commit ("model/data/bench/group_commit", &group_commit_bench);
+
+static void cycling_bench () {
+    using namespace tap;
+    count_syncs();
+    init_test_db(sync_every_commit());
+
+    vector<int64> tabs = create_tabs(0, TabRelation::LAST_CHILD, vector<NewTab>(200, NewTab{"about:blank"}));
+    int64 w = create_window(0, tabs[0]);
+
+     // Simulates holding Ctrl+Tab on tabs with animated titles
+    auto cycle = [&](Str name){
+        constexpr int n_ops = 2000;
+        int64 start_syncs = syncs;
+        auto start = steady_clock::now();
+        for (int i = 0; i < n_ops; i++) {
+            int64 tab = tabs[i % tabs.size()];
+            set_window_focused_tab(w, tab);
+            set_tab_title(tab, std::to_string(i));
+        }
+        flush_relaxed_changes();
+        double time = duration<double>(steady_clock::now() - start).count();
+        double n_syncs = double(syncs - start_syncs);
+        diag(String(name) + ": " + std::to_string(n_syncs / n_ops) + " fsyncs/op, "
+            + std::to_string(n_syncs / time) + " fsyncs/s, "
+            + std::to_string(time / n_ops * 1e6) + "us/op"
+        );
+        return n_syncs;
+    };
+    double relaxed_syncs = cycle("relaxed");
+    set_relaxed_fields(0, 0, 0);
+    double strict_syncs = cycle("strict");
+    ok(relaxed_syncs < strict_syncs / 100, "Relaxed fields save fsyncs");
+    done_testing();
+}
+static tap::TestSet cycling ("model/data/bench/cycling", &cycling_bench);
+
+static void batch_bench () {
+    using namespace tap;
+    init_test_db();
+    State<>::Ment<> create {R"(
+CREATE TABLE batch_test (id INTEGER PRIMARY KEY, url TEXT, created_at REAL)
+    )", true};
+    create.run_void();
+    State<>::Ment<> clear {"DELETE FROM batch_test", true};
+    State<int64>::Ment<> count {"SELECT COUNT(*) FROM batch_test", true};
+    State<>::Ment<int64, Str, double> insert {
+        "INSERT INTO batch_test (id, url, created_at) VALUES (?, ?, ?)", true
+    };
+    MultiInsert<int64, Str, double> multi_insert {
+        "INSERT INTO batch_test (id, url, created_at)"
+    };
+
+    for (size_t n : {1000, 100000}) {
+        vector<tuple<int64, Str, double>> rows;
+        for (size_t i = 0; i < n; i++) rows.emplace_back(i + 1, "about:blank", double(i));
+        auto measure = [&](Str name, auto&& f){
+            clear.run_void();
+            auto start = steady_clock::now();
+            f();
+            double time = duration<double>(steady_clock::now() - start).count();
+            diag(String(name) + " " + std::to_string(n) + ": "
+                + std::to_string(n / time) + " rows/s"
+            );
+            return count.run_single() == int64(n);
+        };
+        bool all_inserted = measure("run_void each", [&]{
+            Savepoint sp;
+            for (auto& [id, url, created_at] : rows) insert.run_void(id, url, created_at);
+            sp.release();
+        });
+        all_inserted &= measure("run_batch", [&]{ insert.run_batch(rows); });
+        all_inserted &= measure("MultiInsert", [&]{ multi_insert.run(rows); });
+        ok(all_inserted, "All rows were inserted every way");
+    }
+
+     // Row 1 is still there, so the last row fails
+    vector<tuple<int64, Str, double>> bad {{1000001, "", 0}, {1000002, "", 0}, {1, "", 0}};
+    int64 before = count.run_single();
+    try { insert.run_batch(bad); } catch (std::exception&) { }
+    is(count.run_single(), before, "run_batch is all or nothing");
+    try { multi_insert.run(bad); } catch (std::exception&) { }
+    is(count.run_single(), before, "MultiInsert is all or nothing");
+    done_testing();
+}
+static tap::TestSet batch ("model/data/bench/batch", &batch_bench);
+
+ // SQLite reuses its buffers when a statement is run again, so the copies it
+ // makes for SQLITE_TRANSIENT don't show up as separate mallocs; ours do.
+static void alloc_bench () {
+    using namespace tap;
+    init_test_db();
+
+     // Long enough that strings can't use the small string buffer
+    String url = "https://example.com/?q=" + String(200, 'x');
+    vector<int64> tabs = create_tabs(0, TabRelation::LAST_CHILD, vector<NewTab>(100, NewTab{url, "Title"}));
+    constexpr int n_ops = 20000;
+
+    auto measure = [&](Str name, auto&& f){
+        int64 start_allocs = allocs;
+        counting_allocs = true;
+        auto start = steady_clock::now();
+        for (int i = 0; i < n_ops; i++) f(tabs[i % tabs.size()], i);
+        double time = duration<double>(steady_clock::now() - start).count();
+        counting_allocs = false;
+        double n_allocs = double(allocs - start_allocs) / n_ops;
+        diag(String(name) + ": " + std::to_string(time / n_ops * 1e6) + "us/op, "
+            + std::to_string(n_allocs) + " allocs/op"
+        );
+        return n_allocs;
+    };
+
+     // Loading rows the old way, through a tuple of Strings, vs in place
+    State<int64, Bifractor, int64, int64, int64, String, String, String, double, double, double, double>
+        ::Ment<int64> get_strings {R"(
+SELECT parent, position, child_count, unvisited_count, starred_count,
+    url, title, favicon, created_at, visited_at, starred_at, closed_at
+FROM tabs WHERE id = ?
+    )"};
+    size_t total = 0;
+    double copied = measure("load via String tuple", [&](int64 id, int){
+        total += make_from_tuple<TabData>(get_strings.run_single(id)).url.size();
+    });
+    size_t copied_total = total;
+    total = 0;
+    double direct = measure("load in place", [&](int64 id, int){
+        TabData data;
+        get_tab_row.run_into(id, data);
+        total += data.url.size();
+    });
+    is(total, copied_total, "Both ways load the same data");
+    ok(direct < copied, "Loading in place allocates less");
+    TabData slot;
+    double reused = measure("load into a reused slot", [&](int64 id, int){
+        get_tab_row.run_into(id, slot);
+    });
+    ok(reused < 0.01, "Loading into a reused slot doesn't allocate");
+
+     // Parameters used to be copied into a String before binding
+    State<int64>::Ment<String> length_of_string {"SELECT length(?)"};
+    State<int64>::Ment<Str> length_of_str {"SELECT length(?)"};
+    copied = measure("bind String copy", [&](int64, int){
+        total += length_of_string.run_single(String(url));
+    });
+    direct = measure("bind Str", [&](int64, int){
+        total += length_of_str.run_single(url);
+    });
+    ok(direct < copied, "Binding without copying allocates less");
+
+    set_relaxed_fields(0, 0, 0);
+    measure("set_tab_title", [&](int64 id, int i){
+        set_tab_title(id, url + std::to_string(i));
+    });
+    start_writer_thread();
+    measure("set_tab_title with writer thread", [&](int64 id, int i){
+        set_tab_title(id, url + std::to_string(i));
+    });
+    stop_writer_thread();
+    done_testing();
 }
+static tap::TestSet alloc ("model/data/bench/alloc", &alloc_bench);
 
+#endif
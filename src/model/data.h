@@ -1,5 +1,8 @@
 #pragma once
 
+#include <future>
+#include <span>
+#include <tuple>
 #include <vector>
 
 #include "../util/bifractor.h"
@@ -14,10 +17,33 @@ enum class TabRelation {
     LAST_CHILD
 };
 
+ // Fields that can be changed without writing to the database immediately.
+ // Changes are written at the end of the transaction.  These are also used to
+ // describe updates, along with a few more that aren't deferred.
+enum TabField : uint32 {
+    TAB_URL = 1 << 0,
+    TAB_TITLE = 1 << 1,
+    TAB_FAVICON = 1 << 2,
+    TAB_VISITED_AT = 1 << 3,
+    TAB_STARRED_AT = 1 << 4,
+    TAB_CLOSED_AT = 1 << 5,
+     // Aggregates come last, in the same order as in data.cpp
+    TAB_CHILD_COUNT = 1 << 6,
+    TAB_UNVISITED_COUNT = 1 << 7,
+    TAB_STARRED_COUNT = 1 << 8,
+     // Only used to describe updates
+    TAB_LOCATION = 1 << 9,  // parent and position
+    TAB_CREATED = 1 << 10,
+    TAB_DELETED = 1 << 11,
+};
+
 struct TabData {
     int64 parent;
     Bifractor position;
+     // These count unclosed descendants that aren't hidden by a closed tab
     int64 child_count;
+    int64 unvisited_count;
+    int64 starred_count;
     String url;
     String title;
     String favicon;
@@ -26,10 +52,16 @@ struct TabData {
     double starred_at;
     double closed_at;
     bool deleted = false;
+     // TabFields that haven't been written to the database yet
+    uint32 dirty = 0;
+     // For reading from the database into
+    TabData () { }
     TabData(
         int64 parent,
         const Bifractor& position,
         int64 child_count,
+        int64 unvisited_count,
+        int64 starred_count,
         Str url,
         Str title,
         Str favicon,
@@ -41,6 +73,8 @@ struct TabData {
         parent(parent),
         position(position),
         child_count(child_count),
+        unvisited_count(unvisited_count),
+        starred_count(starred_count),
         url(url),
         title(title),
         favicon(favicon),
@@ -58,6 +92,20 @@ int64 create_tab (
     Str title = ""
 );
 
+struct NewTab {
+    Str url;
+    Str title = "";
+};
+
+ // Creates all the tabs in order at the given location.  Positions are spread
+ // evenly between the neighbors of the location, instead of bisecting the
+ // same end over and over.
+std::vector<int64> create_tabs (
+    int64 reference,
+    TabRelation rel,
+    std::span<const NewTab> tabs
+);
+
 TabData* get_tab_data (int64 id);
 int64 get_prev_unclosed_tab (int64 id);  // Returns 0 if there is none.
 int64 get_next_unclosed_tab (int64 id);
@@ -80,16 +128,50 @@ void delete_tab_and_children (int64 id);
 void prune_closed_tabs (int64 more_than, double older_than);
 void move_tab (int64 id, int64 parent, const Bifractor& position);
 void move_tab (int64 id, int64 reference, TabRelation rel);
+ // Moves all the tabs in order to one location, adjusting each ancestor's
+ // child count only once.
+void move_tabs (std::span<const int64> ids, int64 reference, TabRelation rel);
 std::pair<int64, Bifractor> make_location (int64 reference, TabRelation rel);
+ // Returns the parent and the positions of the two neighbors between which a
+ // tab at this location would go.  Positions of 0 or 1 mean there's no neighbor
+ // on that side.
+std::tuple<int64, Bifractor, Bifractor> location_bounds (int64 reference, TabRelation rel);
+ // Gives all of parent's children new positions, as short and evenly spaced as
+ // possible, in one transaction, so observers get one update with all of them.
+ // When creating or moving tabs by TabRelation makes a position longer than
+ // the rekey threshold, the same happens on its own, but only to the siblings
+ // around that position, as few as will fit in half the threshold.
+void rekey_children (int64 parent);
+ // The default is 16 bytes, the most a Bifractor holds without allocating.
+void set_rekey_threshold (size_t);
+
+///// SUBTREES
+
+ // The tab and all its descendants, parents before children.
+std::vector<int64> get_subtree (int64 id);
+ // Closes the tab and all of its unclosed descendants at once.
+void close_tab_and_children (int64 id);
+ // Uncloses the tab and every descendant that was closed at the same time.
+void unclose_tab_and_children (int64 id);
 
 ///// WINDOWS
 
+enum WindowField : uint32 {
+    WINDOW_ROOT_TAB = 1 << 0,
+    WINDOW_FOCUSED_TAB = 1 << 1,
+    WINDOW_CLOSED_AT = 1 << 2,
+    WINDOW_CREATED = 1 << 3,
+};
+
 struct WindowData {
     int64 id;
     int64 root_tab;
     int64 focused_tab;
     double created_at;
     double closed_at;
+     // WindowFields that haven't been written to the database yet
+    uint32 dirty = 0;
+    WindowData () { }
     WindowData(
         int64 id,
         int64 root_tab,
@@ -121,18 +203,115 @@ struct Transaction {
     ~Transaction ();
 };
 
+struct TransactionStats {
+     // Including BEGIN and COMMIT
+    uint64 statements = 0;
+    uint64 tabs_written = 0;
+    uint64 windows_written = 0;
+};
+ // For the last top-level transaction that was committed
+const TransactionStats& last_transaction_stats ();
+
+ // Changes to relaxed fields (a mask of TabFields or WindowFields) show up in
+ // the cache and are sent to observers immediately, but they aren't written to
+ // the database until something else is written, flush_relaxed_changes is
+ // called, or a transaction commits when they've been waiting for longer than
+ // max_delay seconds.  Up to max_delay seconds of them can be lost if the
+ // program crashes.  The defaults are visited_at, title, and favicon for tabs,
+ // and focused_tab for windows, with a max_delay of 5 seconds.
+void set_relaxed_fields (uint32 tab_fields, uint32 window_fields, double max_delay);
+ // Call this periodically and at shutdown.  This also does flush_group_commit.
+void flush_relaxed_changes ();
+
+ // Lets top-level transactions that end within window seconds of each other
+ // share one COMMIT.  Each one still rolls back on its own (also when a write
+ // queued for the writer thread fails) and is still sent to observers when it
+ // ends, but it isn't durable until the group is committed.
+ // A group is committed when a transaction ends after the window has passed,
+ // or when flush_group_commit is called.  The default window is 0, which
+ // commits every transaction separately.
+void set_group_commit_window (double window);
+ // Whether some ended transactions haven't been committed yet
+bool group_commit_pending ();
+ // Commit them now.  Call this when the window has passed without another
+ // transaction, and at shutdown.  Does nothing inside a transaction.
+void flush_group_commit ();
+
 struct Observer {
     virtual void Observer_after_commit (
         const std::vector<int64>& updated_tabs,
         const std::vector<int64>& updated_windows
     ) = 0;
-    Observer();
+     // A selective Observer is only given the updated tabs it has registered
+     // interest in with observe_tab.  Others are given all of them.  Both are
+     // given all updated windows.
+    bool selective;
+    Observer(bool selective = false);
     ~Observer();
 };
 
- // Don't do anything but mark the item as updated
-void tab_updated (int64);
-void window_updated (int64);
+ // Give a selective Observer updates to this tab and its descendants up to
+ // depth levels down (as they are after the update).  Tab 0 means the root.
+ // These are counted, so each observe_tab needs a matching unobserve_tab.
+void observe_tab (Observer*, int64 tab, uint32 depth = 0);
+void unobserve_tab (Observer*, int64 tab, uint32 depth = 0);
+
+ // Don't do anything but mark the item as updated.  fields says which
+ // TabFields or WindowFields changed, if that's known.
+void tab_updated (int64, uint32 fields = ~0u);
+void window_updated (int64, uint32 fields = ~0u);
+
+///// WRITER THREAD
+
+ // Moves writes to the database onto another thread, so that committing a
+ // transaction doesn't wait for SQLite to write and fsync.  The cache is
+ // updated right away as usual, and observers are still called at commit.
+ // The thread writes on its own connection (see open_db_connection), so the
+ // database has to be in WAL mode.  Most reads are served from the cache, and
+ // queries read what the writer thread has committed without waiting for it,
+ // unless they depend on writes it hasn't committed yet.  Those wait for the
+ // queued writes to finish and read through its connection.
+void start_writer_thread ();
+ // Waits for queued writes and stops the thread.  Call this before exiting.
+ // If it hasn't been called, it's called at exit, but any error is lost.
+void stop_writer_thread ();
+ // Becomes ready when every transaction committed so far has been committed
+ // by SQLite.  How durable that is depends on the StorageProfile (see
+ // data_init.h).  With the default, WAL with synchronous = NORMAL, the WAL
+ // isn't fsynced at each commit, so the transactions survive the app crashing
+ // but not a power failure or OS crash.  Use synchronous = FULL if they have
+ // to survive those too.
+ //
+ // If a queued write failed, this throws its error (even if other
+ // transactions in the same group were committed), and the transaction it was
+ // in is rolled back in the database.  The error is also thrown by the next
+ // call that reads the database, which throws out what the cache has from that
+ // transaction.  If that call is inside a transaction, the cache is fixed when
+ // the transaction rolls back, which it does even if the error is caught.
+ // Without the writer thread, this is always ready.
+std::shared_future<void> committed_to_disk ();
+
+///// CHANGE FEED
+
+ // Every committed transaction that updated anything gets a version number,
+ // one more than the last.  Versions start at 0 when the program starts.
+uint64 current_version ();
+
+struct Changes {
+     // Pass this to the next changes_since
+    uint64 version;
+     // If false, the log doesn't go back far enough, and tabs and windows are
+     // empty.  Reload whatever you need from scratch.
+    bool complete;
+     // Each id appears once, with every field that changed since.  Sorted by id.
+    std::vector<std::pair<int64, uint32>> tabs;
+    std::vector<std::pair<int64, uint32>> windows;
+};
+ // Everything updated by transactions after version.  Intermediate states are
+ // skipped, so this is cheaper than watching every commit.
+Changes changes_since (uint64 version);
+ // Number of updates to remember.  The default is 100000.
+void set_change_log_limit (size_t);
 
 ///// MISC
 
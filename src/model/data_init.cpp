@@ -1,9 +1,12 @@
 #include "data_init.h"
 
+#include <atomic>
+#include <chrono>
 #include <filesystem>
 #include <stdexcept>
 #include <sqlite3.h>
 
+#include "../util/bifractor_sql.h"
 #include "../util/db_support.h"
 #include "../util/error.h"
 #include "../util/files.h"
@@ -12,15 +15,90 @@
 #include "data.h"
 
 using namespace std;
+using namespace std::chrono;
 
 sqlite3* db = nullptr;
 
-void init_db (const String& db_file) {
+///// Checkpointer
+
+ // These are updated by whichever thread commits (see start_writer_thread)
+static atomic<int> wal_pages = 0;
+static atomic<double> last_wal_commit = 0;
+static int max_wal_pages = 0;
+
+static double steady_now () {
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+static int on_wal_commit (void*, sqlite3*, const char*, int pages) {
+    wal_pages = pages;
+    last_wal_commit = steady_now();
+    return SQLITE_OK;
+}
+
+static State<int, int, int>::Ment<> passive_checkpoint {"PRAGMA wal_checkpoint(PASSIVE)"};
+bool idle_checkpoint (double idle_seconds) {
+    if (!max_wal_pages || !wal_pages) return false;
+    if (wal_pages < max_wal_pages
+     && steady_now() - last_wal_commit < idle_seconds
+    ) return false;
+     // Can't checkpoint in the middle of a transaction.
+    if (group_commit_pending()) return false;
+    LOG("idle_checkpoint", int(wal_pages));
+    auto [busy, log, done] = passive_checkpoint.run_single();
+     // If it didn't get everything, try again next time.
+    if (!busy && log == done) wal_pages = 0;
+    return true;
+}
+
+void final_checkpoint () {
+    finish_preparing();
+    if (!max_wal_pages) return;
+    LOG("final_checkpoint");
+    State<int, int, int>::Ment<> checkpoint {"PRAGMA wal_checkpoint(TRUNCATE)", true};
+    checkpoint.run_single();
+    wal_pages = 0;
+}
+
+///// Opening
+
+static void apply_storage_profile (sqlite3* conn, const StorageProfile& profile) {
+    String sql = "PRAGMA journal_mode = "s + (profile.wal ? "WAL" : "DELETE")
+        + ";\nPRAGMA synchronous = "s + std::to_string(profile.synchronous)
+        + ";\nPRAGMA mmap_size = "s + std::to_string(profile.mmap_bytes)
+        + ";\nPRAGMA temp_store = "s + (profile.temp_store_memory ? "MEMORY" : "DEFAULT")
+        + ";\n"s;
+     // Negative means KiB instead of pages
+    if (profile.cache_kib) {
+        sql += "PRAGMA cache_size = -"s + std::to_string(profile.cache_kib) + ";\n"s;
+    }
+    AS(conn, sqlite3_exec(conn, sql.c_str(), nullptr, nullptr, nullptr));
+    if (profile.wal && profile.manual_checkpoints) {
+        AS(conn, sqlite3_wal_autocheckpoint(conn, 0));
+    }
+}
+
+static StorageProfile db_profile;
+
+static void setup_connection (sqlite3* conn) {
+    apply_storage_profile(conn, db_profile);
+    register_bifractor_functions(conn);
+    if (db_profile.wal && db_profile.manual_checkpoints) {
+        sqlite3_wal_hook(conn, &on_wal_commit, nullptr);
+    }
+}
+
+static int open_db (const String& db_file, const StorageProfile& profile) {
     AA(!db);
     LOG("init_db", db_file);
     bool exists = filesystem::exists(db_file) && filesystem::file_size(db_file) > 0;
 
     AS(db, sqlite3_open(db_file.c_str(), &db));
+    db_profile = profile;
+    setup_connection(db);
+    if (profile.wal && profile.manual_checkpoints) {
+        max_wal_pages = profile.max_wal_pages;
+    }
 
     String sql_dir = exe_relative("res/model/sql");
 
@@ -28,7 +106,7 @@ void init_db (const String& db_file) {
          // Migrate database to new schema if necessary
         State<int>::Ment<> get_version {"PRAGMA user_version", true};
         int version = get_version.run_single();
-        if (version == CURRENT_SCHEMA_VERSION) return;
+        if (version == CURRENT_SCHEMA_VERSION) return version;
 
         LOG("Migrating schema", version, CURRENT_SCHEMA_VERSION);
         Transaction tr;
@@ -57,11 +135,22 @@ void init_db (const String& db_file) {
             AS(db, sqlite3_exec(db, sql.c_str(), nullptr, nullptr, nullptr));
             [[fallthrough]];
         }
-        case 4:
+        case 4: {
             String sql = slurp(sql_dir + "/migrate-4-5.sql");
             AS(db, sqlite3_exec(db, sql.c_str(), nullptr, nullptr, nullptr));
+            [[fallthrough]];
+        }
+        case 5: {
+            String sql = slurp(sql_dir + "/migrate-5-6.sql");
+            AS(db, sqlite3_exec(db, sql.c_str(), nullptr, nullptr, nullptr));
+            [[fallthrough]];
+        }
+        case 6:
+            String sql = slurp(sql_dir + "/migrate-6-7.sql");
+            AS(db, sqlite3_exec(db, sql.c_str(), nullptr, nullptr, nullptr));
         }
         LOG("Migration complete.");
+        return version;
     }
     else {
          // Create new database
@@ -72,6 +161,167 @@ void init_db (const String& db_file) {
         LOG("Creating database...");
         AS(db, sqlite3_exec(db, schema.c_str(), nullptr, nullptr, nullptr));
         LOG("Creation complete.");
+        return CURRENT_SCHEMA_VERSION;
+    }
+}
+
+void init_db (const String& db_file, const StorageProfile& profile) {
+     // In case statements were being prepared for a previous database
+    finish_preparing();
+    int old_version = open_db(db_file, profile);
+    prepare_statements();
+    load_tab_index();
+     // Version 6 added unvisited_count and starred_count
+    if (old_version < 6) rebuild_tab_aggregates();
+}
+
+sqlite3* open_db_connection () {
+    AA(db);
+    AA(db_profile.wal);
+    sqlite3* conn;
+    AS(conn, sqlite3_open(sqlite3_db_filename(db, "main"), &conn));
+    setup_connection(conn);
+    return conn;
+}
+
+#ifndef TAP_DISABLE_TESTS
+#include <random>
+
+#include "../tap/tap.h"
+
+ // Something like what a browsing session does to the database
+static void tab_workload () {
+    minstd_rand rng;
+    vector<int64> tabs = create_tabs(0, TabRelation::LAST_CHILD, vector<NewTab>(100, NewTab{"about:blank"}));
+    int64 w = create_window(0, tabs[0]);
+    for (int i = 0; i < 3000; i++) {
+        int64 tab = tabs[rng() % tabs.size()];
+        bool closed = !!get_tab_data(tab)->closed_at;
+        switch (rng() % 10) {
+            case 0: case 1: case 2:
+                if (closed) unclose_tab(tab);
+                set_window_focused_tab(w, tab);
+                break;
+            case 3: case 4: set_tab_title(tab, "Title "s + std::to_string(i)); break;
+            case 5: set_tab_url(tab, "https://example.com/"s + std::to_string(i)); break;
+            case 6: set_tab_favicon(tab, "https://example.com/favicon.ico"); break;
+            case 7: star_tab(tab); break;
+            case 8: tabs.push_back(create_tab(tab, TabRelation::LAST_CHILD, "about:blank")); break;
+            case 9: if (closed) unclose_tab(tab); else close_tab(tab); break;
+        }
+         // The app does this on a timer
+        if (i % 100 == 0) flush_relaxed_changes();
+    }
+    flush_relaxed_changes();
+}
+
+static void storage_bench () {
+    using namespace tap;
+    String folder = exe_relative("test"sv);
+    if (!logstream) {
+        filesystem::create_directories(folder);
+        init_log(folder + "/model-storage.log"sv);
+    }
+    String db_file = folder + "/model-storage.sqlite"sv;
+    for (auto suffix : {"", "-wal", "-shm"}) filesystem::remove(db_file + suffix);
+    init_db(db_file);
+
+     // Record every statement the model runs, with its parameters filled in
+    vector<String> recorded;
+    sqlite3_trace_v2(db, SQLITE_TRACE_STMT,
+        [](unsigned, void* ctx, void* stmt, void* sql) {
+             // Statements run by triggers are replayed by their triggers
+            if (Str((const char*)sql).starts_with("--")) return 0;
+            char* expanded = sqlite3_expanded_sql((sqlite3_stmt*)stmt);
+            ((vector<String>*)ctx)->emplace_back(expanded);
+            sqlite3_free(expanded);
+            return 0;
+        }, &recorded
+    );
+    tab_workload();
+    sqlite3_trace_v2(db, 0, nullptr, nullptr);
+    State<int64>::Ment<> count_tabs {"SELECT count(*) FROM tabs", true};
+    int64 n_tabs = count_tabs.run_single();
+    size_t n_commits = std::count(recorded.begin(), recorded.end(), "COMMIT"s);
+
+    String schema = slurp(exe_relative(
+        "res/model/sql/schema-"s + std::to_string(CURRENT_SCHEMA_VERSION) + ".sql"s
+    ));
+    String replay_file = folder + "/model-storage-replay.sqlite"sv;
+
+    auto replay = [&](const StorageProfile& profile){
+        for (auto suffix : {"", "-wal", "-shm"}) filesystem::remove(replay_file + suffix);
+        sqlite3* conn;
+        AS(conn, sqlite3_open(replay_file.c_str(), &conn));
+        apply_storage_profile(conn, profile);
+        AS(conn, sqlite3_exec(conn, schema.c_str(), nullptr, nullptr, nullptr));
+        bool manual = profile.wal && profile.manual_checkpoints;
+        double checkpoint_time = 0;
+        size_t commits = 0;
+        auto start = steady_clock::now();
+        for (auto& sql : recorded) {
+            AS(conn, sqlite3_exec(conn, sql.c_str(), nullptr, nullptr, nullptr));
+             // Pretend the app goes idle every so often
+            if (sql == "COMMIT"sv && ++commits % 200 == 0 && manual) {
+                auto cp_start = steady_clock::now();
+                AS(conn, sqlite3_wal_checkpoint_v2(conn, nullptr, SQLITE_CHECKPOINT_PASSIVE, nullptr, nullptr));
+                checkpoint_time += duration<double>(steady_clock::now() - cp_start).count();
+            }
+        }
+        if (manual) {
+            auto cp_start = steady_clock::now();
+            AS(conn, sqlite3_wal_checkpoint_v2(conn, nullptr, SQLITE_CHECKPOINT_TRUNCATE, nullptr, nullptr));
+            checkpoint_time += duration<double>(steady_clock::now() - cp_start).count();
+        }
+        double time = duration<double>(steady_clock::now() - start).count();
+        sqlite3_stmt* count;
+        AS(conn, sqlite3_prepare_v2(conn, "SELECT count(*) FROM tabs", -1, &count, nullptr));
+        sqlite3_step(count);
+        int64 replayed_tabs = sqlite3_column_int64(count, 0);
+        sqlite3_finalize(count);
+        AS(conn, sqlite3_close(conn));
+
+        static const char* sync_names [] = {"OFF", "NORMAL", "FULL"};
+        diag(String(profile.wal ? "WAL" : "DELETE")
+            + " sync=" + sync_names[profile.synchronous]
+            + " cache=" + std::to_string(profile.cache_kib) + "KiB"
+            + " mmap=" + std::to_string(profile.mmap_bytes >> 20) + "MiB"
+            + " temp=" + (profile.temp_store_memory ? "MEMORY" : "DEFAULT")
+            + (profile.wal ? manual ? " manual" : " auto" : "")
+            + ": " + std::to_string((time - checkpoint_time) / n_commits * 1e6) + "us/commit"
+            + (manual ? ", checkpoints " + std::to_string(checkpoint_time * 1000) + "ms" : "")
+        );
+        return replayed_tabs;
+    };
+
+    bool all_match = true;
+    for (bool wal : {false, true})
+    for (int synchronous : {2, 1})
+    for (int64 cache_kib : {0, 8192})
+    for (int64 mmap_bytes : {0, 64 << 20})
+    for (bool temp_store_memory : {false, true})
+    for (bool manual_checkpoints : {false, true}) {
+        if (!wal && manual_checkpoints) continue;
+        StorageProfile profile;
+        profile.wal = wal;
+        profile.synchronous = synchronous;
+        profile.cache_kib = cache_kib;
+        profile.mmap_bytes = mmap_bytes;
+        profile.temp_store_memory = temp_store_memory;
+        profile.manual_checkpoints = manual_checkpoints;
+        if (replay(profile) != n_tabs) all_match = false;
     }
+    ok(all_match, "Replayed "s + std::to_string(recorded.size()) + " statements in "
+        + std::to_string(n_commits) + " commits with every profile"
+    );
+
+    set_tab_title(get_all_children(0)[0], "After workload");
+    ok(idle_checkpoint(0), "idle_checkpoint checkpoints when idle");
+    ok(!idle_checkpoint(0), "idle_checkpoint doesn't checkpoint with nothing new");
+    final_checkpoint();
+    is(filesystem::file_size(db_file + "-wal"), uintmax_t(0), "final_checkpoint truncates the WAL");
+    done_testing();
 }
+static tap::TestSet storage ("model/data/bench/storage", &storage_bench);
 
+#endif
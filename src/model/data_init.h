@@ -4,8 +4,52 @@
 
 #include "../util/types.h"
 
-constexpr int CURRENT_SCHEMA_VERSION = 5;
+constexpr int CURRENT_SCHEMA_VERSION = 7;
 
 extern sqlite3* db;
 
-void init_db (const String& db_path);
+ // How the database file is set up.  The defaults were picked with the
+ // model/data/bench/storage benchmark.
+struct StorageProfile {
+     // Use a write-ahead log instead of a rollback journal
+    bool wal = true;
+     // PRAGMA synchronous: 0 = OFF, 1 = NORMAL, 2 = FULL.  NORMAL can't corrupt
+     // the database in WAL mode, but the last commits before a power failure
+     // or OS crash can be lost, since the WAL is only fsynced at checkpoints.
+     // Commits survive the app itself crashing either way.
+    int synchronous = 1;
+     // Page cache size in KiB, or 0 for SQLite's default
+    int64 cache_kib = 8192;
+     // How much of the file to memory-map, or 0 to not use mmap
+    int64 mmap_bytes = 0;
+     // Keep temporary tables and indexes in memory instead of in files
+    bool temp_store_memory = true;
+     // In WAL mode, don't checkpoint after commits.  Call idle_checkpoint and
+     // final_checkpoint instead.
+    bool manual_checkpoints = true;
+     // Checkpoint anyway once the WAL has this many pages, even if not idle
+    int max_wal_pages = 10000;
+};
+
+void init_db (const String& db_path, const StorageProfile& = StorageProfile());
+
+ // Opens another connection to the same database, set up the same way.  The
+ // writer thread uses one, so that reads on db don't wait for its commits.
+ // Requires WAL, since otherwise a write would lock the other connection out.
+sqlite3* open_db_connection ();
+
+ // With manual checkpoints, call this periodically.  Does a PASSIVE checkpoint
+ // if something has been committed since the last one and nothing has been
+ // committed for idle_seconds, or if the WAL has gotten too big.  Returns
+ // whether it checkpointed.
+bool idle_checkpoint (double idle_seconds = 2);
+ // Call at shutdown, after flushing changes.  Checkpoints everything and
+ // truncates the WAL.
+void final_checkpoint ();
+
+ // Defined in data.cpp.  Reads the tree structure of the tabs table into
+ // memory.  Called by init_db.
+void load_tab_index ();
+ // Defined in data.cpp.  Recalculates child_count and the other totals for
+ // every tab.  Called by init_db after a migration that adds a total.
+void rebuild_tab_aggregates ();
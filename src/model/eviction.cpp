@@ -0,0 +1,363 @@
+#include "eviction.h"
+
+#include "../util/error.h"
+
+using namespace std;
+
+EvictionPolicy::Priority EvictionPolicy::priority (int64 tab, const Entry& e) {
+    int rank = !e.visited_at ? 2 : e.starred_at ? 1 : 0;
+    return Priority(rank, e.visited_at, tab);
+}
+
+ // Puts an entry in recent, pushing the least recent one out if necessary
+void EvictionPolicy::link (int64 tab, Entry& e) {
+    recent.emplace(e.visited_at, tab);
+    e.recent = true;
+    if (recent.size() > keep_recent) {
+        int64 oldest = recent.begin()->second;
+        recent.erase(recent.begin());
+        make_older(oldest, entries.at(oldest));
+    }
+}
+
+void EvictionPolicy::make_older (int64 tab, Entry& e) {
+    e.recent = false;
+    older.emplace(e.visited_at, tab);
+    if (!pins.count(tab)) candidates.insert(priority(tab, e));
+}
+
+ // Takes an entry out of all the sets, filling its place in recent if needed
+void EvictionPolicy::unlink (int64 tab, Entry& e) {
+    if (e.recent) {
+        recent.erase(Recency(e.visited_at, tab));
+        e.recent = false;
+        if (!older.empty()) {
+            int64 newest = prev(older.end())->second;
+            older.erase(prev(older.end()));
+            Entry& ne = entries.at(newest);
+            candidates.erase(priority(newest, ne));
+            recent.emplace(ne.visited_at, newest);
+            ne.recent = true;
+        }
+    }
+    else {
+        older.erase(Recency(e.visited_at, tab));
+        candidates.erase(priority(tab, e));
+    }
+}
+
+void EvictionPolicy::add (int64 tab, double visited_at, double starred_at, uint64 c) {
+    auto [iter, added] = entries.emplace(tab, Entry{visited_at, starred_at, c});
+    AA(added);
+    cost += c;
+    link(tab, iter->second);
+}
+
+void EvictionPolicy::remove (int64 tab) {
+    auto iter = entries.find(tab);
+    if (iter == entries.end()) return;
+    unlink(tab, iter->second);
+    cost -= iter->second.cost;
+    entries.erase(iter);
+}
+
+void EvictionPolicy::update (int64 tab, double visited_at, double starred_at) {
+    auto iter = entries.find(tab);
+    if (iter == entries.end()) return;
+    Entry& e = iter->second;
+    if (e.visited_at == visited_at && e.starred_at == starred_at) return;
+    unlink(tab, e);
+    e.visited_at = visited_at;
+    e.starred_at = starred_at;
+    link(tab, e);
+}
+
+void EvictionPolicy::set_cost (int64 tab, uint64 c) {
+    auto iter = entries.find(tab);
+    if (iter == entries.end()) return;
+    cost = cost - iter->second.cost + c;
+    iter->second.cost = c;
+}
+
+void EvictionPolicy::pin (int64 tab) {
+    if (pins[tab]++) return;
+    auto iter = entries.find(tab);
+    if (iter != entries.end() && !iter->second.recent) {
+        candidates.erase(priority(tab, iter->second));
+    }
+}
+
+void EvictionPolicy::unpin (int64 tab) {
+    auto pin_iter = pins.find(tab);
+    AA(pin_iter != pins.end());
+    if (--pin_iter->second) return;
+    pins.erase(pin_iter);
+    auto iter = entries.find(tab);
+    if (iter != entries.end() && !iter->second.recent) {
+        candidates.insert(priority(tab, iter->second));
+    }
+}
+
+bool EvictionPolicy::over_budget () const {
+    return entries.size() > max_count || (max_cost && cost > max_cost);
+}
+
+vector<int64> EvictionPolicy::evict (int64 keep) {
+    vector<int64> r;
+    if (!over_budget()) return r;
+    if (keep) pin(keep);
+    while (over_budget() && !candidates.empty()) {
+        int64 victim = std::get<2>(*candidates.begin());
+        remove(victim);
+        r.push_back(victim);
+    }
+    if (keep) unpin(keep);
+    return r;
+}
+
+#ifndef TAP_DISABLE_TESTS
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <random>
+
+#include "../tap/tap.h"
+
+using namespace std::chrono;
+
+ // Stands in for the app's Activities, which need a window system.  Keeps
+ // track of how many are alive so leaks show up.
+struct FakeActivity {
+    static inline int64 alive = 0;
+    int64 tab;
+    FakeActivity (int64 tab) : tab(tab) { alive += 1; }
+    ~FakeActivity () { alive -= 1; }
+};
+
+struct FakeTab {
+    double visited_at = 0;
+    double starred_at = 0;
+};
+
+ // Does what App does with activities, minus the webviews
+struct FakeApp {
+    EvictionPolicy policy;
+    unordered_map<int64, FakeTab> tabs;
+    unordered_map<int64, unique_ptr<FakeActivity>> activities;
+    double clock = 0;
+
+    FakeApp (const EvictionPolicy& policy) : policy(policy) { }
+
+    FakeActivity* ensure (int64 tab, uint64 cost = 1) {
+        auto iter = activities.find(tab);
+        if (iter != activities.end()) return iter->second.get();
+        iter = activities.emplace(tab, make_unique<FakeActivity>(tab)).first;
+        auto& t = tabs[tab];
+        policy.add(tab, t.visited_at, t.starred_at, cost);
+        for (int64 victim : policy.evict(tab)) {
+            activities.erase(victim);
+        }
+        return iter->second.get();
+    }
+    void visit (int64 tab) {
+        tabs[tab].visited_at = clock += 1;
+        policy.update(tab, tabs[tab].visited_at, tabs[tab].starred_at);
+    }
+    void star (int64 tab) {
+        tabs[tab].starred_at = clock += 1;
+        policy.update(tab, tabs[tab].visited_at, tabs[tab].starred_at);
+    }
+    void close (int64 tab) {
+        activities.erase(tab);
+        policy.remove(tab);
+    }
+};
+
+ // The victim App used to pick, by scanning everything.  Used to check the
+ // policy's choices.
+static int64 linear_victim (
+    const FakeApp& app, const unordered_map<int64, uint32>& pinned, int64 keep
+) {
+    vector<pair<double, int64>> by_recency;
+    for (auto& [id, a] : app.activities) {
+        by_recency.emplace_back(app.tabs.at(id).visited_at, id);
+    }
+    sort(by_recency.rbegin(), by_recency.rend());
+    by_recency.resize(min(by_recency.size(), app.policy.keep_recent));
+
+    int64 victim = 0;
+    tuple<int, double, int64> best;
+    for (auto& [id, a] : app.activities) {
+        if (id == keep || pinned.count(id)) continue;
+        auto& t = app.tabs.at(id);
+        if (find(by_recency.begin(), by_recency.end(), pair(t.visited_at, id)) != by_recency.end()) continue;
+        auto p = tuple(!t.visited_at ? 2 : t.starred_at ? 1 : 0, t.visited_at, id);
+        if (!victim || p < best) {
+            victim = id;
+            best = p;
+        }
+    }
+    return victim;
+}
+
+static void eviction_tests () {
+    using namespace tap;
+    {
+        FakeApp app (EvictionPolicy(5, 0, 2));
+        for (int64 t = 1; t <= 5; t++) {
+            app.ensure(t);
+            app.visit(t);
+        }
+        is(app.activities.size(), size_t(5), "Nothing is evicted under budget");
+        app.ensure(6);
+        app.visit(6);
+        is(app.activities.size(), size_t(5), "Loading a tab over budget evicts one");
+        ok(!app.activities.count(1), "Least recently visited tab is evicted first");
+
+        app.star(2);
+        app.ensure(7);
+        app.visit(7);
+        ok(app.activities.count(2) && !app.activities.count(3), "Starred tabs are evicted after unstarred ones");
+
+        app.policy.pin(4);
+        app.ensure(8);
+        app.visit(8);
+        ok(app.activities.count(4) && !app.activities.count(5), "Pinned tabs aren't evicted");
+
+        app.ensure(9);
+        ok(app.activities.count(9), "The tab being loaded isn't evicted");
+        ok(!app.activities.count(6), "Visited tabs are evicted before the unvisited one being loaded");
+        app.ensure(10);
+        ok(!app.activities.count(2), "Starred tab is evicted when no unstarred one is left");
+        app.ensure(11);
+        ok(app.activities.count(7) && app.activities.count(8), "Most recently visited tabs are kept");
+        ok(!app.activities.count(9) && app.activities.count(10), "Unvisited tabs are evicted last");
+        is(app.policy.count(), app.activities.size(), "Policy agrees with fake app on count");
+
+        app.policy.unpin(4);
+        app.policy.max_count = 2;
+        app.ensure(12);
+        is(app.activities.size(), size_t(3), "Can't evict below the recent tabs and the new one");
+        is(FakeActivity::alive, int64(3), "Evicted fake activities are destroyed");
+    }
+    {
+        FakeApp app (EvictionPolicy(100, 1000, 0));
+        for (int64 t = 1; t <= 10; t++) {
+            app.ensure(t, 150);
+            app.visit(t);
+        }
+        is(app.policy.total_cost(), uint64(900), "Cost budget is enforced");
+        is(app.activities.size(), size_t(6), "Cost budget evicts enough tabs");
+        app.policy.set_cost(10, 400);
+        app.ensure(11, 100);
+        is(app.policy.total_cost(), uint64(950), "set_cost is counted");
+    }
+    {
+         // Random operations, checked against a linear scan
+        constexpr int64 n_tabs = 300;
+        FakeApp app (EvictionPolicy(40, 0, 8));
+        unordered_map<int64, uint32> pinned;
+        minstd_rand rng;
+        bool agreed = true;
+        for (int i = 0; i < 20000 && agreed; i++) {
+            int64 tab = 1 + rng() % n_tabs;
+            switch (rng() % 8) {
+                case 0: app.star(tab); break;
+                case 1: app.close(tab); break;
+                case 2: {
+                    if (pinned.size() < 5 && !pinned.count(tab)) {
+                        pinned[tab] = 1;
+                        app.policy.pin(tab);
+                    }
+                    else if (pinned.count(tab)) {
+                        pinned.erase(tab);
+                        app.policy.unpin(tab);
+                    }
+                    break;
+                }
+                default: {
+                    if (!app.activities.count(tab)) {
+                        app.activities.emplace(tab, make_unique<FakeActivity>(tab));
+                        auto& t = app.tabs[tab];
+                        app.policy.add(tab, t.visited_at, t.starred_at);
+                        while (app.policy.over_budget()) {
+                            int64 expected = linear_victim(app, pinned, tab);
+                            auto victims = app.policy.evict(tab);
+                            int64 got = victims.empty() ? 0 : victims[0];
+                            if (got != expected) {
+                                diag("Expected victim " + std::to_string(expected)
+                                    + ", got " + std::to_string(got));
+                                agreed = false;
+                            }
+                            if (!got) break;
+                            app.activities.erase(got);
+                        }
+                    }
+                    if (rng() % 2) app.visit(tab);
+                    break;
+                }
+            }
+        }
+        ok(agreed, "Victims agree with a linear scan");
+        is(app.policy.count(), app.activities.size(), "Policy agrees with fake app after random operations");
+    }
+    is(FakeActivity::alive, int64(0), "No fake activities leaked");
+    done_testing();
+}
+static tap::TestSet tests ("model/eviction", &eviction_tests);
+
+static void eviction_bench () {
+    using namespace tap;
+    for (size_t n : {100, 1000, 10000, 100000}) {
+         // Keep n loaded, and load random tabs out of 4n
+        constexpr int n_ops = 10000;
+        FakeApp app (EvictionPolicy(n, 0, 20));
+        minstd_rand rng;
+        for (size_t i = 0; i < n; i++) {
+            app.ensure(1 + i);
+            app.visit(1 + i);
+        }
+        vector<int64> ids;
+        for (int i = 0; i < n_ops; i++) ids.push_back(1 + rng() % (4 * n));
+
+        auto start = steady_clock::now();
+        for (int64 id : ids) {
+            app.ensure(id);
+            app.visit(id);
+        }
+        double policy_time = duration<double>(steady_clock::now() - start).count();
+
+         // The same, picking victims the old way
+        FakeApp old_app (EvictionPolicy(n, 0, 20));
+        for (size_t i = 0; i < n; i++) {
+            old_app.ensure(1 + i);
+            old_app.visit(1 + i);
+        }
+        unordered_map<int64, uint32> no_pins;
+        int n_old_ops = n > 10000 ? n_ops / 100 : n_ops;
+        start = steady_clock::now();
+        for (int i = 0; i < n_old_ops; i++) {
+            int64 id = ids[i];
+            if (!old_app.activities.count(id)) {
+                old_app.activities.emplace(id, make_unique<FakeActivity>(id));
+                old_app.tabs[id];
+                if (old_app.activities.size() > n) {
+                    int64 victim = linear_victim(old_app, no_pins, id);
+                    old_app.activities.erase(victim);
+                }
+            }
+            old_app.tabs[id].visited_at = old_app.clock += 1;
+        }
+        double linear_time = duration<double>(steady_clock::now() - start).count();
+
+        is(app.activities.size(), n, std::to_string(n) + " loaded: budget is kept");
+        diag(std::to_string(n) + " loaded: "
+            + "policy " + std::to_string(policy_time / n_ops * 1e6) + "us/op, "
+            + "linear " + std::to_string(linear_time / n_old_ops * 1e6) + "us/op"
+        );
+    }
+    done_testing();
+}
+static tap::TestSet bench ("model/eviction/bench", &eviction_bench);
+
+#endif
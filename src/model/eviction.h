@@ -0,0 +1,83 @@
+#pragma once
+
+#include <set>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#include "../util/types.h"
+
+///// EVICTION
+
+ // Decides which loaded tabs to unload when too many are loaded.  It doesn't
+ // know how tabs are loaded; the app tells it what's loaded with add and
+ // remove, and unloads whatever evict returns.  Nothing here touches the
+ // database, so it's cheap enough to run every time a tab is loaded.
+ //
+ // Tabs are unloaded in this order:
+ //   1. visited, unstarred tabs, least recently visited first
+ //   2. starred tabs, least recently visited first
+ //   3. tabs that were loaded but never visited (probably preloaded)
+ // Pinned tabs and the keep_recent most recently visited tabs are never
+ // unloaded.
+struct EvictionPolicy {
+     // Maximum number of loaded tabs
+    size_t max_count;
+     // Maximum total cost of loaded tabs, 0 for no limit
+    uint64 max_cost;
+     // Number of most recently visited loaded tabs to keep regardless
+    size_t keep_recent;
+
+    EvictionPolicy (size_t max_count = 80, uint64 max_cost = 0, size_t keep_recent = 20) :
+        max_count(max_count), max_cost(max_cost), keep_recent(keep_recent)
+    { }
+
+     // Start or stop tracking a loaded tab.  cost is in whatever unit
+     // max_cost is in.
+    void add (int64 tab, double visited_at, double starred_at, uint64 cost = 1);
+    void remove (int64 tab);
+    bool contains (int64 tab) const { return entries.count(tab); }
+
+     // Call when a loaded tab's data changes.  Does nothing for a tab that
+     // isn't loaded.
+    void update (int64 tab, double visited_at, double starred_at);
+    void set_cost (int64 tab, uint64 cost);
+
+     // Pins are counted, so a tab stays pinned until every pin is removed.
+     // Tabs can be pinned whether or not they're loaded.
+    void pin (int64 tab);
+    void unpin (int64 tab);
+
+    size_t count () const { return entries.size(); }
+    uint64 total_cost () const { return cost; }
+    bool over_budget () const;
+
+     // Removes tabs until the budget is met or nothing more can be unloaded,
+     // and returns them so the caller can unload them.  keep is treated as
+     // pinned.
+    std::vector<int64> evict (int64 keep = 0);
+
+  private:
+    struct Entry {
+        double visited_at;
+        double starred_at;
+        uint64 cost;
+        bool recent = false;
+    };
+    using Recency = std::pair<double, int64>;
+    using Priority = std::tuple<int, double, int64>;
+
+    std::unordered_map<int64, Entry> entries;
+    std::unordered_map<int64, uint32> pins;
+    uint64 cost = 0;
+     // The keep_recent most recently visited entries, and all the others
+    std::set<Recency> recent;
+    std::set<Recency> older;
+     // Entries that can be unloaded (older and not pinned), first victim first
+    std::set<Priority> candidates;
+
+    static Priority priority (int64 tab, const Entry&);
+    void link (int64 tab, Entry&);
+    void unlink (int64 tab, Entry&);
+    void make_older (int64 tab, Entry&);
+};
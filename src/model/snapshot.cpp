@@ -0,0 +1,175 @@
+#include "snapshot.h"
+
+#include "../util/error.h"
+
+using namespace std;
+
+const TabSnapshot* TreeSnapshot::get (int64 id) const {
+    if (id <= 0) return nullptr;
+    size_t s = size_t(id) >> 16;
+    if (s >= superchunks.size() || !superchunks[s]) return nullptr;
+    auto& chunk = (*superchunks[s])[(id >> 8) & 255];
+    if (!chunk) return nullptr;
+    return (*chunk)[id & 255].get();
+}
+
+const vector<int64>& TreeSnapshot::children (int64 id) const {
+    static const vector<int64> none;
+    if (!id) return root_children ? *root_children : none;
+    auto tab = get(id);
+    return tab && tab->children ? *tab->children : none;
+}
+
+SnapshotBuilder::SnapshotBuilder (const TreeSnapshot* base, uint64 version) :
+    snapshot(base ? make_shared<TreeSnapshot>(*base) : make_shared<TreeSnapshot>())
+{
+    snapshot->version = version;
+}
+
+void SnapshotBuilder::set_tab (int64 id, shared_ptr<const TabSnapshot> tab) {
+    AA(snapshot);
+    AA(id > 0);
+    size_t s = size_t(id) >> 16;
+    size_t c = size_t(id) >> 8;
+    auto& chunk = copied_chunks[c];
+    if (!chunk) {
+        auto& superchunk = copied_superchunks[s];
+        if (!superchunk) {
+            if (s >= snapshot->superchunks.size()) {
+                snapshot->superchunks.resize(s + 1);
+            }
+            auto& old = snapshot->superchunks[s];
+            superchunk = old
+                ? make_shared<TreeSnapshot::Superchunk>(*old)
+                : make_shared<TreeSnapshot::Superchunk>();
+            old = superchunk;
+        }
+        auto& old = (*superchunk)[c & 255];
+        chunk = old
+            ? make_shared<TreeSnapshot::Chunk>(*old)
+            : make_shared<TreeSnapshot::Chunk>();
+        old = chunk;
+    }
+    auto& slot = (*chunk)[id & 255];
+    snapshot->size += size_t(!!tab) - size_t(!!slot);
+    slot = move(tab);
+}
+
+void SnapshotBuilder::set_root_children (shared_ptr<const vector<int64>> children) {
+    AA(snapshot);
+    snapshot->root_children = move(children);
+}
+
+shared_ptr<const TreeSnapshot> SnapshotBuilder::finish () {
+    AA(snapshot);
+    copied_superchunks.clear();
+    copied_chunks.clear();
+    return move(snapshot);
+}
+
+#ifndef TAP_DISABLE_TESTS
+#include <filesystem>
+#include <thread>
+
+#include "../tap/tap.h"
+#include "../util/files.h"
+#include "../util/log.h"
+#include "data.h"
+#include "data_init.h"
+
+ // Checks a snapshot against the live model, tab by tab
+static bool snapshot_matches_model (const TreeSnapshot& snap) {
+    size_t count = 0;
+    vector<int64> todo {0};
+    while (!todo.empty()) {
+        int64 id = todo.back();
+        todo.pop_back();
+        if (snap.children(id) != get_all_children(id)) return false;
+        for (int64 child : snap.children(id)) {
+            auto s = snap.get(child);
+            auto t = get_tab_data(child);
+            if (!s || s->parent != id || s->position != t->position
+             || s->title != t->title || s->closed_at != t->closed_at
+             || s->child_count != t->child_count
+            ) {
+                tap::diag("Tab " + std::to_string(child) + " doesn't match");
+                return false;
+            }
+            count += 1;
+            todo.push_back(child);
+        }
+    }
+    return count == snap.size;
+}
+
+static void snapshot_tests () {
+    using namespace tap;
+    String folder = exe_relative("test"sv);
+    if (!logstream) {
+        filesystem::create_directories(folder);
+        init_log(folder + "/model-snapshot.log"sv);
+    }
+    String db_file = folder + "/model-snapshot.sqlite"sv;
+    for (auto suffix : {"", "-wal", "-shm"}) filesystem::remove(db_file + suffix);
+    init_db(db_file);
+
+    ok(!current_snapshot(), "No snapshot before start_snapshots");
+    int64 a = create_tab(0, TabRelation::LAST_CHILD, "about:blank", "A");
+    int64 b = create_tab(0, TabRelation::LAST_CHILD, "about:blank", "B");
+    vector<NewTab> new_tabs (1000, NewTab{"about:blank", "Child"});
+    vector<int64> children = create_tabs(b, TabRelation::LAST_CHILD, new_tabs);
+    start_snapshots();
+    auto first = current_snapshot();
+    ok(!!first, "start_snapshots publishes a snapshot");
+    ok(snapshot_matches_model(*first), "First snapshot matches model");
+
+    set_tab_title(a, "A2");
+    auto second = current_snapshot();
+    is(first->get(a)->title, "A"s, "Old snapshot doesn't change");
+    is(second->get(a)->title, "A2"s, "New snapshot has the change");
+    is(second->version, current_version(), "Snapshot has the current version");
+    ok(first->get(children[500]) == second->get(children[500]), "Unchanged tabs are shared");
+
+    move_tab(children[10], a, TabRelation::LAST_CHILD);
+    close_tab(children[20]);
+    delete_tab_and_children(children[30]);
+    auto third = current_snapshot();
+    ok(snapshot_matches_model(*third), "Snapshot matches model after moving, closing and deleting");
+    is(third->children(a), vector<int64>{children[10]}, "Moved tab is in its new parent");
+    ok(!third->get(children[30]), "Deleted tab is gone");
+    is(second->children(b).size(), size_t(1000), "Old snapshot still has the old children");
+
+     // Read snapshots on another thread while this one keeps changing things
+    bool all_ok = true;
+    std::thread reader ([&]{
+        for (int i = 0; i < 200; i++) {
+            auto snap = current_snapshot();
+            size_t count = 0;
+            vector<int64> todo {0};
+            while (!todo.empty()) {
+                int64 id = todo.back();
+                todo.pop_back();
+                for (int64 child : snap->children(id)) {
+                    auto s = snap->get(child);
+                    if (!s || s->parent != id) all_ok = false;
+                    count += 1;
+                    todo.push_back(child);
+                }
+            }
+            if (count != snap->size) all_ok = false;
+        }
+    });
+    for (int i = 0; i < 200; i++) {
+        int64 t = children[100 + i];
+        move_tab(t, children[400 + i], TabRelation::FIRST_CHILD);
+        set_tab_title(t, "Moved");
+    }
+    reader.join();
+    ok(all_ok, "Snapshots are consistent on another thread");
+    ok(snapshot_matches_model(*current_snapshot()), "Snapshot matches model at the end");
+
+    done_testing();
+}
+static tap::TestSet tests ("model/snapshot", &snapshot_tests);
+
+#endif
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <array>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "../util/bifractor.h"
+#include "../util/types.h"
+
+///// SNAPSHOTS
+
+ // A read-only copy of one tab as of some commit.  See TabData in data.h.
+struct TabSnapshot {
+    int64 id;
+    int64 parent;
+    Bifractor position;
+    int64 child_count;
+    int64 unvisited_count;
+    int64 starred_count;
+    String url;
+    String title;
+    String favicon;
+    double created_at;
+    double visited_at;
+    double starred_at;
+    double closed_at;
+     // All children in order, including closed ones
+    std::shared_ptr<const std::vector<int64>> children;
+};
+
+ // The whole tab tree as of some commit.  Nothing in it ever changes, so any
+ // thread can hold onto one and read it without locking, while the model
+ // thread keeps going.  Parts that didn't change are shared with the previous
+ // snapshot, so publishing one per commit only copies what changed.
+struct TreeSnapshot {
+     // The change feed version this is from.  changes_since(version) says
+     // what changed after it.
+    uint64 version = 0;
+    size_t size = 0;
+
+     // nullptr if there is no such tab
+    const TabSnapshot* get (int64 id) const;
+     // 0 for the root
+    const std::vector<int64>& children (int64 id) const;
+
+     // Tabs are found by id through two levels of 256-way tables.
+    using Chunk = std::array<std::shared_ptr<const TabSnapshot>, 256>;
+    using Superchunk = std::array<std::shared_ptr<const Chunk>, 256>;
+    std::vector<std::shared_ptr<const Superchunk>> superchunks;
+    std::shared_ptr<const std::vector<int64>> root_children;
+};
+
+ // Makes a new snapshot out of an old one.  Each table that gets changed is
+ // copied once, the first time it's changed.
+struct SnapshotBuilder {
+    std::shared_ptr<TreeSnapshot> snapshot;
+
+     // base can be null to start from nothing
+    SnapshotBuilder (const TreeSnapshot* base, uint64 version);
+     // Pass null to remove the tab
+    void set_tab (int64 id, std::shared_ptr<const TabSnapshot>);
+    void set_root_children (std::shared_ptr<const std::vector<int64>>);
+    std::shared_ptr<const TreeSnapshot> finish ();
+
+  private:
+    std::unordered_map<size_t, std::shared_ptr<TreeSnapshot::Superchunk>> copied_superchunks;
+    std::unordered_map<size_t, std::shared_ptr<TreeSnapshot::Chunk>> copied_chunks;
+};
+
+ // Starts publishing a snapshot at every commit that changes a tab.  The first
+ // one is made right away, which loads every tab, so this isn't free.  Call
+ // this on the model's thread.  Nothing in the app calls this yet, on purpose:
+ // everything that reads the tree runs on the model's thread and uses
+ // get_tab_data.  Whatever first reads the tree from another thread should
+ // call this when it starts.
+void start_snapshots ();
+ // The latest published snapshot, or null if start_snapshots hasn't been
+ // called.  This can be called from any thread.  The snapshot is kept in a
+ // std::atomic<std::shared_ptr>, which isn't lock-free (on MSVC it takes a
+ // spin lock inside the atomic for each load and store).  So a load costs a
+ // short lock plus a reference count bump, and the model thread's store can
+ // make readers spin briefly.  Load once per batch of reads, not once per tab.
+std::shared_ptr<const TreeSnapshot> current_snapshot ();
@@ -0,0 +1,4 @@
+PRAGMA user_version = 6;
+ -- These are filled in by rebuild_tab_aggregates after migrating.
+ALTER TABLE tabs ADD COLUMN unvisited_count INTEGER NOT NULL DEFAULT 0;
+ALTER TABLE tabs ADD COLUMN starred_count INTEGER NOT NULL DEFAULT 0;
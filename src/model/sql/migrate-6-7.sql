@@ -0,0 +1,4 @@
+PRAGMA user_version = 7;
+CREATE INDEX unclosed_tabs_by_visited_at ON tabs (
+    visited_at
+) WHERE closed_at IS NULL;
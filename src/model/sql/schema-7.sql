@@ -1,4 +1,4 @@
-PRAGMA user_version = 5;
+PRAGMA user_version = 7;
 
 ----- TABS
 
@@ -15,10 +15,14 @@ CREATE TABLE tabs (
     closed_at REAL,
     favicon TEXT,  -- Deduplicating can come later.
     starred_at REAL,
+    unvisited_count INTEGER NOT NULL DEFAULT 0,
+    starred_count INTEGER NOT NULL DEFAULT 0,
     CHECK(id > 0),
     CHECK(parent >= 0 AND parent <> id),
     CHECK(position > X'00' AND position < X'ff'),
-    CHECK(child_count >= 0)
+    CHECK(child_count >= 0),
+    CHECK(unvisited_count >= 0),
+    CHECK(starred_count >= 0)
 );
 
 CREATE UNIQUE INDEX tabs_by_location ON tabs (
@@ -34,6 +38,10 @@ CREATE INDEX unvisited_tabs_by_created_at ON tabs (
     created_at
 ) WHERE visited_at IS NULL;
 
+CREATE INDEX unclosed_tabs_by_visited_at ON tabs (
+    visited_at
+) WHERE closed_at IS NULL;
+
 CREATE INDEX closed_tabs_by_closed_at ON tabs (
     closed_at
 ) WHERE closed_at IS NOT NULL;
@@ -0,0 +1,17 @@
+#include "alloc_count.h"
+
+#ifndef TAP_DISABLE_TESTS
+#include <cstdlib>
+#include <new>
+
+std::atomic<bool> counting_allocs = false;
+std::atomic<int64> allocs = 0;
+
+void* operator new (size_t n) {
+    if (counting_allocs) allocs += 1;
+    if (void* p = std::malloc(n ? n : 1)) return p;
+    throw std::bad_alloc();
+}
+void operator delete (void* p) noexcept { std::free(p); }
+void operator delete (void* p, size_t) noexcept { std::free(p); }
+#endif
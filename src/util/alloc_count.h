@@ -0,0 +1,14 @@
+#pragma once
+
+ // For benchmarks.  Counts allocations made through the global operator new,
+ // on any thread, while counting_allocs is set.  This replaces operator new
+ // for the whole program, so it's only compiled in with the tests.
+
+#include <atomic>
+
+#include "types.h"
+
+#ifndef TAP_DISABLE_TESTS
+extern std::atomic<bool> counting_allocs;
+extern std::atomic<int64> allocs;
+#endif
@@ -1,5 +1,6 @@
 #include "bifractor.h"
 
+#include <cstring>
 #include <memory>
 #include <stdexcept>
 
@@ -27,87 +28,264 @@ std::string Bifractor::hex () const {
     return r;
 }
 
+///// Bisection
+ // Bytestrings are treated as base-256 fractions, stored big-endian in fixed
+ // size arrays of n digits.  Digit 0 is the integer part, which is only used
+ // to catch overflow.
+
+static int compare_digits (const uint8* x, const uint8* y, size_t n) {
+    return memcmp(x, y, n);
+}
+
+ // r += x, where the result fits
+static void add_digits (uint8* r, const uint8* x, size_t n) {
+    uint carry = 0;
+    for (size_t i = n; i-- > 0;) {
+        uint v = r[i] + x[i] + carry;
+        r[i] = uint8(v);
+        carry = v >> 8;
+    }
+}
+
+ // r -= x, where x <= r
+static void subtract_digits (uint8* r, const uint8* x, size_t n) {
+    int borrow = 0;
+    for (size_t i = n; i-- > 0;) {
+        int v = r[i] - x[i] - borrow;
+        r[i] = uint8(v);
+        borrow = v < 0;
+    }
+}
+
+ // r = floor(r * m / 65536), where m <= 65536
+static void scale_digits (uint8* r, uint32 m, size_t n) {
+     // Work from the bottom, dropping the two digits that get shifted out
+    uint64 carry = 0;
+    for (size_t i = n; i-- > 0;) {
+        uint64 v = uint64(r[i]) * m + carry;
+        if (i + 2 < n) r[i + 2] = uint8(v);
+        carry = v >> 8;
+    }
+    r[1] = uint8(carry);
+    r[0] = uint8(carry >> 8);
+}
+
+ // Rounds x to the nearest multiple of 256^-p.  Returns false on overflow.
+static bool round_digits (uint8* x, size_t p, size_t n) {
+    if (p + 1 >= n) return true;
+    bool up = x[p + 1] >= 0x80;
+    memset(x + p + 1, 0, n - p - 1);
+    if (!up) return true;
+    for (size_t i = p + 1; i-- > 0;) {
+        if (++x[i]) return i > 0;
+    }
+    return false;
+}
+
 Bifractor::Bifractor (const Bifractor& a, const Bifractor& b, float bias) :
     Bifractor()
 {
     AA(a.size);
     AA(b.size);
     AA(bias >= 0 && bias <= 1);
-    size_t max_size = (a.size > b.size ? a.size : b.size) + 1;
-
-    uint8 stack_buf [128];
+     // The target is a + (b - a) * bias, computed with a few bytes more
+     // precision than either side so that there's always room for it.  The
+     // result is the shortest bytestring within a margin of the target, where
+     // the margin is half the distance to the nearer side.  Working over the
+     // whole interval instead of just the first byte that differs keeps the
+     // bias effective when the sides are close together.
+    size_t n = 1 + (a.size > b.size ? a.size : b.size) + 3;
+    uint8 stack_buf [6 * 128];
     std::unique_ptr<uint8[]> heap_buf (
-        max_size <= 128 ? nullptr : new uint8[max_size]
+        n <= 128 ? nullptr : new uint8[6 * n]
     );
-    uint8* buf = max_size <= 128 ? stack_buf : heap_buf.get();
-
-    uint carry_b = 0;
-    for (size_t i = 0; i < max_size; i++) {
-         // Extend a and b infinitely to the right with 0x00
-        uint av = (i < a.size ? a.bytes()[i] : 0);
-        uint bv = (i < b.size ? b.bytes()[i] : 0) + carry_b;
-        if (av > bv) {
-            ERR("Tried to bisect two Bifractors that were in the wrong order."sv);
-        }
-        else if (av == bv) {
-            buf[i] = av;
-        }
-        else if (av + 1 == bv) {
-            buf[i] = av;
-            carry_b = 0x100;
+    uint8* buf = n <= 128 ? stack_buf : heap_buf.get();
+    memset(buf, 0, 6 * n);
+    uint8* lo = buf;
+    uint8* hi = buf + n;
+    uint8* target = buf + 2*n;
+    uint8* margin = buf + 3*n;
+    uint8* candidate = buf + 4*n;
+    uint8* distance = buf + 5*n;
+    memcpy(lo + 1, a.bytes(), a.size);
+    memcpy(hi + 1, b.bytes(), b.size);
+
+    int order = compare_digits(lo, hi, n);
+    if (order > 0) {
+        ERR("Tried to bisect two Bifractors that were in the wrong order."sv);
+    }
+    else if (order == 0) {
+        ERR("Tried to bisect two Bifractors that were equal."sv);
+    }
+
+     // Bias as a fraction of 65536, kept off the ends so that the target
+     // can't land on either side.
+    uint32 bias16 = uint32(bias * 65536 + 0.5);
+    if (bias16 < 1) bias16 = 1;
+    if (bias16 > 65535) bias16 = 65535;
+
+    memcpy(target, hi, n);
+    subtract_digits(target, lo, n);
+    memcpy(margin, target, n);
+    scale_digits(target, bias16, n);
+    add_digits(target, lo, n);
+    scale_digits(margin, (bias16 < 32768 ? bias16 : 65536 - bias16) / 2, n);
+
+    for (size_t p = 1; p < n; p++) {
+        memcpy(candidate, target, n);
+        if (!round_digits(candidate, p, n)) continue;
+        if (compare_digits(candidate, lo, n) <= 0) continue;
+        if (compare_digits(candidate, hi, n) >= 0) continue;
+        if (compare_digits(candidate, target, n) >= 0) {
+            memcpy(distance, candidate, n);
+            subtract_digits(distance, target, n);
         }
         else {
-             // Lerp between the lower and upper bound (then round)
-            uint middle = uint(av * (1 - bias) + bv * bias + 0.5);
-             // Make sure we don't accidentally equal either side.  Lerping
-             // between av+1 and bv-1 instead would save us from having to do
-             // this adjustment, but it would make the bias less effective.
-            if (middle == av) middle += 1;
-            if (middle == bv) middle -= 1;
-            buf[i] = middle;
-
-            const_cast<size_t&>(size) = i+1;
-            if (size > sizeof(ptr)) {
-                const_cast<const uint8*&>(ptr) = new uint8 [size];
-            }
-            for (size_t i = 0; i < size; i++) {
-                const_cast<uint8*>(bytes())[i] = buf[i];
-            }
+            memcpy(distance, target, n);
+            subtract_digits(distance, candidate, n);
+        }
+        if (compare_digits(distance, margin, n) > 0) continue;
+
+        size_t new_size = p;
+        while (new_size > 1 && !candidate[new_size]) new_size -= 1;
+        const_cast<size_t&>(size) = new_size;
+        std::memcpy(allocate(), candidate + 1, size);
 #ifndef NDEBUG
-            try { validate(*this); }
-            catch (...) { this->~Bifractor(); throw; }
+        try { validate(*this); }
+        catch (...) { this->~Bifractor(); throw; }
 #endif
-            return;
-        }
+        return;
     }
-    ERR("Tried to bisect two Bifractors that were equal."sv);
+     // Rounding to n-1 digits leaves the target alone, which is always in
+     // range, so this can't happen.
+    AA(false);
 }
 
 Bifractor::Bifractor (const uint8* bytes_ptr, size_t bytes_size) :
-    size(bytes_size)
+    size(bytes_size), heap{nullptr, false}
 {
-    if (size > sizeof(ptr)) {
-        const_cast<const uint8*&>(ptr) = new uint8 [size];
-    }
-    for (size_t i = 0; i < size; i++) {
-        const_cast<uint8*>(bytes())[i] = bytes_ptr[i];
-    }
+    std::memcpy(allocate(), bytes_ptr, size);
     try { validate(*this); }
     catch (...) { this->~Bifractor(); throw; }
 }
 
-int operator <=> (const Bifractor& a, const Bifractor& b) {
-    int r = memcmp(a.bytes(), b.bytes(), a.size < b.size ? a.size : b.size);
-    if (r) return r;
-    return int(a.size - b.size);
+Bifractor BifractorArena::copy (const Bifractor& b) {
+    if (b.size <= Bifractor::inline_capacity) return b;
+    if (b.size > left) {
+        size_t n = b.size > block_size ? b.size : block_size;
+        blocks.emplace_back(new uint8 [n]);
+        next = blocks.back().get();
+        left = n;
+    }
+    uint8* p = next;
+    std::memcpy(p, b.bytes(), b.size);
+    next += b.size;
+    left -= b.size;
+    used += b.size;
+    return Bifractor(p, b.size, Bifractor::Borrow{});
+}
+
+///// Spreading
+ // Between low and high there are always enough bytestrings of some length p,
+ // so every result is p bytes long (or shorter if it happens to end in 0x00).
+ // Treating the first p bytes of low and high as integers, there are
+ // count = high - low - 1 bytestrings between them (one more if high has more
+ // than p bytes), and the results are evenly spaced among those.
+
+struct Spread {
+    size_t length;
+    uint64 count;
+};
+
+static uint8 digit (const Bifractor& b, size_t i) {
+    return i < b.size ? b.bytes()[i] : 0;
+}
+
+static Spread plan_spread (const Bifractor& low, const Bifractor& high, size_t n) {
+    AA(low.size);
+    AA(high.size);
+    if (!(low < high)) {
+        ERR("Tried to spread between two Bifractors that weren't in order."sv);
+    }
+     // The difference between the first p bytes of high and low only gets
+     // multiplied by 256 every byte, so it can't get much bigger than n.
+    uint64 difference = 0;
+    for (size_t p = 1;; p++) {
+        difference = difference * 256 + digit(high, p-1) - digit(low, p-1);
+        uint64 count = difference + (p < high.size) - 1;
+        if (difference && count >= n) return Spread{p, count};
+        AA(difference < uint64(1) << 55);
+    }
+}
+
+ // The offset from low of the i'th result
+static uint64 spread_offset (const Spread& spread, size_t i, size_t n) {
+     // (i + 1) * (count + 1) / (n + 1) without overflowing
+    uint64 q = (spread.count + 1) / (n + 1);
+    uint64 r = (spread.count + 1) % (n + 1);
+    return q * (i + 1) + r * (i + 1) / (n + 1);
+}
+
+ // Adds offset to the p-byte integer in buf
+static void add_offset (uint8* buf, size_t p, uint64 offset) {
+    for (size_t i = p; offset && i-- > 0;) {
+        offset += buf[i];
+        buf[i] = uint8(offset);
+        offset >>= 8;
+    }
+    AA(!offset);
+}
+
+static size_t trimmed_size (const uint8* buf, size_t p) {
+    while (p > 1 && !buf[p-1]) p -= 1;
+    return p;
+}
+
+void spread_bifractors (
+    std::vector<Bifractor>& out, const Bifractor& low, const Bifractor& high, size_t n
+) {
+    if (!n) return;
+    Spread spread = plan_spread(low, high, n);
+    uint8 stack_buf [128];
+    std::unique_ptr<uint8[]> heap_buf (
+        spread.length <= 128 ? nullptr : new uint8[spread.length]
+    );
+    uint8* buf = spread.length <= 128 ? stack_buf : heap_buf.get();
+    for (size_t i = 0; i < spread.length; i++) buf[i] = digit(low, i);
+     // Step from one result to the next instead of starting over every time
+    uint64 prev_offset = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint64 offset = spread_offset(spread, i, n);
+        add_offset(buf, spread.length, offset - prev_offset);
+        prev_offset = offset;
+        out.emplace_back(buf, trimmed_size(buf, spread.length));
+    }
+}
+
+Bifractor spread_bifractor (
+    const Bifractor& low, const Bifractor& high, size_t i, size_t n
+) {
+    AA(i < n);
+    Spread spread = plan_spread(low, high, n);
+    uint8 stack_buf [128];
+    std::unique_ptr<uint8[]> heap_buf (
+        spread.length <= 128 ? nullptr : new uint8[spread.length]
+    );
+    uint8* buf = spread.length <= 128 ? stack_buf : heap_buf.get();
+    for (size_t j = 0; j < spread.length; j++) buf[j] = digit(low, j);
+    add_offset(buf, spread.length, spread_offset(spread, i, n));
+    return Bifractor(buf, trimmed_size(buf, spread.length));
 }
 
 #ifndef TAP_DISABLE_TESTS
+#include <algorithm>
+#include <bit>
+#include <chrono>
 #include "../tap/tap.h"
 
 static void bifractor_tests () {
     using namespace tap;
-    plan(24);
+    plan(29);
     srand(uint(time(0)));
 
     Bifractor zero {0};
@@ -147,13 +325,9 @@ static void bifractor_tests () {
             b = new_b;
         }
         ok(okay, "Continually bifracting downwards, biased");
-         // Why is this +4 and not +1?  Because only the last byte in the
-         // bytestring is lerped, rather than the entire remaining interval,
-         // making biases less effective when the last bytes are close together.
-         // In the extreme case where the last bytes are 2 apart, the bias is
-         // completely meaningless, and the last byte is set to the only value
-         // left between them.
-        is(b.size, 1111 / 128 + 4, "Biased bifracting results in smaller string");
+         // Each step only takes 1/32 off the interval, which is log2(32/31) or
+         // about 0.046 bits, so 1111 steps need about 51 bits.
+        is(b.size, 51 / 8 + 1, "Biased bifracting results in smaller string");
     }
     {
         Bifractor b {1};
@@ -167,7 +341,13 @@ static void bifractor_tests () {
             b = new_b;
         }
         ok(okay, "Continually bifracting downwards, wrongly biased");
-        is(b.size, 1111 / 2 + 1, "Wrongly biased bifracting results in larger string");
+         // And this takes 31/32 off every time, which is 5 bits.  This used to
+         // be 4 bits (1111 / 2 + 1 bytes), because only the first differing
+         // byte was biased, so the bias was partly ignored.  Honoring it is
+         // what makes the right direction cost 0.046 bits per step instead of
+         // about 0.09, and the model only biases toward the side it expects
+         // more tabs on, so the wrong direction is the rare one.
+        is(b.size, 1111 * 5 / 8 + 1, "Wrongly biased bifracting results in larger string");
     }
     {
         Bifractor b {0};
@@ -195,8 +375,7 @@ static void bifractor_tests () {
             b = new_b;
         }
         ok(okay, "Continually bifracting upwards, biased");
-         // Why +4 and not +1?  See the explanation above.
-        is(b.size, 1111 / 128 + 4, "Biased bifracting results in smaller string");
+        is(b.size, 51 / 8 + 1, "Biased bifracting results in smaller string");
     }
     {
         Bifractor b {0};
@@ -210,7 +389,8 @@ static void bifractor_tests () {
             b = new_b;
         }
         ok(okay, "Continually bifracting upwards, wrongly biased");
-        is(b.size, 1111 / 2 + 1, "Wrongly biased bifracting results in larger string");
+         // 5 bits per step, as with downwards above
+        is(b.size, 1111 * 5 / 8 + 1, "Wrongly biased bifracting results in larger string");
     }
     {
         Bifractor b {Bifractor{0}, Bifractor{1}};
@@ -264,7 +444,293 @@ static void bifractor_tests () {
         "C0",
         "Brief test of hex()"
     );
+    {
+         // Spread between random bounds, made by wandering around randomly
+        bool in_order = true;
+        bool short_enough = true;
+        bool single_ok = true;
+        Bifractor low_b = zero;
+        Bifractor high_b = one;
+        for (size_t i = 0; i < 200; i++) {
+            size_t n = 1 + rand() % (i % 10 ? 100 : 5000);
+            std::vector<Bifractor> spread;
+            spread_bifractors(spread, low_b, high_b, n);
+            if (spread.size() != n) in_order = false;
+            for (size_t j = 0; j < spread.size(); j++) {
+                const Bifractor& prev = j ? spread[j-1] : low_b;
+                if (spread[j] <= prev || spread[j] >= high_b) in_order = false;
+            }
+             // At a byte past the longer bound there's room for 255
+             // bytestrings, and 256 times as many at every byte after that.
+            size_t longest_allowed = std::max(low_b.size, high_b.size);
+            for (size_t room = 1; room < n + 1; room *= 256) longest_allowed += 1;
+            for (auto& b : spread) {
+                if (b.size > longest_allowed) short_enough = false;
+            }
+            size_t j = rand() % n;
+            if (spread_bifractor(low_b, high_b, j, n) != spread[j]) single_ok = false;
+            Bifractor b {low_b, high_b, (rand() % 101) / 100.f};
+            if (rand() & 1) low_b = b;
+            else high_b = b;
+        }
+        ok(in_order, "spread_bifractors makes n Bifractors in order between the bounds");
+        ok(short_enough, "spread_bifractors makes short Bifractors");
+        ok(single_ok, "spread_bifractor gets the same one as spread_bifractors");
+    }
+    {
+         // There are 254 one-byte Bifractors between 0 and 1
+        auto longest = [&](size_t n){
+            std::vector<Bifractor> spread;
+            spread_bifractors(spread, zero, one, n);
+            size_t r = 0;
+            for (auto& b : spread) r = std::max(r, b.size);
+            return r;
+        };
+        is(longest(254), size_t(1), "spread_bifractors uses every one-byte Bifractor first");
+        is(longest(255), size_t(2), "spread_bifractors goes to two bytes when it has to");
+    }
 }
 static tap::TestSet tests ("util/bifractor", &bifractor_tests);
 
+ // What operator <=> used to do instead of memcmp: compare 8 bytes at a time
+ // as big-endian words, then a byte at a time.  It's kept here to show it
+ // doesn't beat memcmp on real keys.
+static uint64 load_big_endian (const uint8* p) {
+    uint64 w;
+    std::memcpy(&w, p, 8);
+    if constexpr (std::endian::native == std::endian::little) {
+        w = (w & 0x00ff00ff00ff00ff) << 8 | (w >> 8 & 0x00ff00ff00ff00ff);
+        w = (w & 0x0000ffff0000ffff) << 16 | (w >> 16 & 0x0000ffff0000ffff);
+        w = w << 32 | w >> 32;
+    }
+    return w;
+}
+static bool words_less (const Bifractor& a, const Bifractor& b) {
+    size_t n = std::min(a.size, b.size);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64 x = load_big_endian(a.bytes() + i);
+        uint64 y = load_big_endian(b.bytes() + i);
+        if (x != y) return x < y;
+    }
+    for (; i < n; i++) {
+        if (a.bytes()[i] != b.bytes()[i]) return a.bytes()[i] < b.bytes()[i];
+    }
+    return a.size < b.size;
+}
+
+ // Makes n positions the way the model does for a workload, and returns all
+ // the positions that were made along the way.
+static std::vector<Bifractor> workload (Str name, size_t n) {
+    Bifractor zero {0};
+    Bifractor one {1};
+    std::vector<Bifractor> made;
+    std::vector<Bifractor> siblings;
+    auto insert = [&](size_t i, float bias){
+        const Bifractor& low = i ? siblings[i-1] : zero;
+        const Bifractor& high = i < siblings.size() ? siblings[i] : one;
+        Bifractor b {low, high, bias};
+        made.push_back(b);
+        siblings.insert(siblings.begin() + i, std::move(b));
+    };
+    for (size_t i = 0; i < n; i++) {
+        if (name == "append") insert(siblings.size(), 1/32.0);
+        else if (name == "prepend") insert(0, 31/32.0);
+        else if (name == "random") insert(rand() % (siblings.size() + 1), 0.5);
+        else if (name == "drag") {
+             // Reorder a couple hundred tabs with BEFORE and AFTER
+            if (siblings.size() < 200) insert(siblings.size(), 1/32.0);
+            else {
+                siblings.erase(siblings.begin() + rand() % siblings.size());
+                if (rand() & 1) insert(rand() % siblings.size(), 15/16.0);
+                else insert(rand() % siblings.size() + 1, 1/16.0);
+            }
+        }
+    }
+    return made;
+}
+
+static void bifractor_bench () {
+    using namespace tap;
+    srand(uint(time(0)));
+    using namespace std::chrono;
+
+    Bifractor long_b (reinterpret_cast<const uint8*>("0123456789abcdefghij"), 20);
+    const uint8* long_bytes = long_b.bytes();
+    Bifractor moved = std::move(long_b);
+    ok(moved.bytes() == long_bytes, "Move construction takes the storage");
+    Bifractor assigned;
+    assigned = std::move(moved);
+    ok(assigned.bytes() == long_bytes, "Move assignment takes the storage");
+    is(moved.size, size_t(0), "Moved-from Bifractor is empty");
+
+    BifractorArena arena;
+    Bifractor in_arena = arena.copy(assigned);
+    ok(in_arena == assigned && in_arena.heap.borrowed, "Long Bifractors are copied into the arena");
+    Bifractor out_of_arena = in_arena;
+    ok(out_of_arena == assigned && !out_of_arena.heap.borrowed, "Copying one out of the arena makes a normal one");
+    ok(arena.copy(Bifractor{0}).size == 1 && arena.bytes_used() == 20, "Short Bifractors aren't put in the arena");
+
+    size_t total = 0;
+    size_t fit_8 = 0;
+    size_t fit_inline = 0;
+     // A parent with a few thousand appended children is where keys get past
+     // 8 bytes, so measure that too.
+    for (auto [name, n] : std::initializer_list<std::pair<Str, size_t>>{
+        {"append", 1000}, {"append", 3000}, {"prepend", 1000}, {"prepend", 3000},
+        {"random", 1000}, {"random", 3000}, {"drag", 1000}, {"drag", 10000}
+    }) {
+        auto made = workload(name, n);
+        size_t lengths [5] = {};
+        for (auto& b : made) {
+            lengths[b.size <= 4 ? 0 : b.size <= 8 ? 1 : b.size <= 16 ? 2 : b.size <= 32 ? 3 : 4] += 1;
+            fit_8 += b.size <= 8;
+            fit_inline += b.size <= Bifractor::inline_capacity;
+        }
+        total += made.size();
+        diag(String(name) + " " + std::to_string(n) + " lengths: <=4: " + std::to_string(lengths[0])
+            + ", 5-8: " + std::to_string(lengths[1])
+            + ", 9-16: " + std::to_string(lengths[2])
+            + ", 17-32: " + std::to_string(lengths[3])
+            + ", >32: " + std::to_string(lengths[4])
+        );
+
+         // Every copy of a key too long to be inline is an allocation
+        auto start = steady_clock::now();
+        for (int i = 0; i < 10; i++) {
+            std::vector<Bifractor> copies = made;
+        }
+        double copy_time = duration<double>(steady_clock::now() - start).count();
+        start = steady_clock::now();
+        std::vector<Bifractor> arena_copies;
+        arena_copies.reserve(made.size());
+        BifractorArena workload_arena;
+        for (auto& b : made) arena_copies.push_back(workload_arena.copy(b));
+        double arena_time = duration<double>(steady_clock::now() - start).count();
+        start = steady_clock::now();
+        std::sort(made.begin(), made.end(), [](auto& a, auto& b){ return a < b; });
+        double sort_time = duration<double>(steady_clock::now() - start).count();
+        diag(String(name) + " " + std::to_string(n) + ": copy " + std::to_string(copy_time / 10 / made.size() * 1e9)
+            + "ns/key, arena copy " + std::to_string(arena_time / made.size() * 1e9)
+            + "ns/key, sort " + std::to_string(sort_time / made.size() * 1e9) + "ns/key"
+        );
+    }
+    diag("Allocations per copy with 8 bytes inline: " + std::to_string(1 - double(fit_8) / total)
+        + ", with " + std::to_string(Bifractor::inline_capacity) + ": "
+        + std::to_string(1 - double(fit_inline) / total)
+        + ", sizeof(Bifractor): " + std::to_string(sizeof(Bifractor))
+    );
+    ok(fit_inline > total * 0.95, "Nearly all keys fit inline");
+
+     // Looking up keys the way the tab index does, with operator <=> (which
+     // uses memcmp) and with words_less, on the same kinds of keys as above
+    bool lookups_agree = true;
+    for (auto [name, n] : std::initializer_list<std::pair<Str, size_t>>{
+        {"append", 3000}, {"random", 3000}, {"drag", 10000}
+    }) {
+        auto keys = workload(name, n);
+        std::sort(keys.begin(), keys.end(), [](auto& a, auto& b){ return a < b; });
+        auto lookups = [&](auto less){
+            size_t found = 0;
+            auto start = steady_clock::now();
+            for (int i = 0; i < 10; i++) {
+                for (auto& k : keys) {
+                    found += std::lower_bound(keys.begin(), keys.end(), k, less) - keys.begin();
+                }
+            }
+            double time = duration<double>(steady_clock::now() - start).count();
+            return std::pair(time / 10 / keys.size(), found);
+        };
+        auto [memcmp_time, memcmp_found] = lookups([](auto& a, auto& b){ return a < b; });
+        auto [words_time, words_found] = lookups(&words_less);
+        if (memcmp_found != words_found) lookups_agree = false;
+        diag(String(name) + " " + std::to_string(n) + " lower_bound: memcmp "
+            + std::to_string(memcmp_time * 1e9) + "ns, 8 bytes at a time "
+            + std::to_string(words_time * 1e9) + "ns"
+        );
+    }
+    ok(lookups_agree, "Comparing 8 bytes at a time finds the same keys as memcmp");
+
+     // How long keys get as a workload keeps going
+    size_t longest_append = 0;
+    for (Str name : {"append", "prepend", "random"}) {
+        String line = String(name) + " longest key after";
+        for (size_t n : {100, 1000, 10000}) {
+            auto made = workload(name, n);
+            size_t longest = 0;
+            for (auto& b : made) if (b.size > longest) longest = b.size;
+            line += " " + std::to_string(n) + ": " + std::to_string(longest);
+            if (name == "append") longest_append = longest;
+        }
+        diag(line);
+    }
+     // 10000 steps of log2(32/31) bits each is about 58 bytes
+    ok(longest_append <= 60, "Biased appending keeps keys short");
+
+     // Making n keys at once: bisecting the same end over and over, bisecting
+     // recursively, and spread_bifractors
+    auto bisect_recursively = [](
+        auto& self, std::vector<Bifractor>& out,
+        const Bifractor& low, const Bifractor& high, size_t n
+    ) -> void {
+        if (!n) return;
+        Bifractor middle {low, high};
+        self(self, out, low, middle, n / 2);
+        out.push_back(middle);
+        self(self, out, middle, high, n - 1 - n / 2);
+    };
+    bool spread_shorter = true;
+    for (size_t n : {100, 10000, 1000000}) {
+        Bifractor zero {0};
+        Bifractor one {1};
+        auto report = [&](Str how, const std::vector<Bifractor>& keys, double time){
+            size_t total = 0;
+            size_t longest = 0;
+            for (auto& b : keys) {
+                total += b.size;
+                longest = std::max(longest, b.size);
+            }
+            diag(std::to_string(n) + " keys " + String(how) + ": "
+                + std::to_string(double(total) / n) + " bytes average, "
+                + std::to_string(longest) + " longest, "
+                + std::to_string(n / time / 1e6) + "M keys/s"
+            );
+            return longest;
+        };
+        if (n <= 10000) {
+            std::vector<Bifractor> keys;
+            auto start = steady_clock::now();
+            for (size_t i = 0; i < n; i++) {
+                keys.emplace_back(i ? keys.back() : zero, one);
+            }
+            report("bisecting one end", keys,
+                duration<double>(steady_clock::now() - start).count()
+            );
+        }
+        std::vector<Bifractor> recursive;
+        auto start = steady_clock::now();
+        bisect_recursively(bisect_recursively, recursive, zero, one, n);
+        double recursive_time = duration<double>(steady_clock::now() - start).count();
+        size_t recursive_longest = report("bisecting recursively", recursive, recursive_time);
+
+        std::vector<Bifractor> spread;
+        start = steady_clock::now();
+        spread_bifractors(spread, zero, one, n);
+        double spread_time = duration<double>(steady_clock::now() - start).count();
+        size_t spread_longest = report("spread_bifractors", spread, spread_time);
+         // Recursive bisection lands on more keys that end in 0x00 and get
+         // trimmed, so its average can be a little lower, but its longest
+         // keys are never shorter.
+        if (spread_longest > recursive_longest) spread_shorter = false;
+         // Timing depends too much on the machine to be a test
+        diag(std::to_string(n) + " keys: spread_bifractors takes "
+            + std::to_string(spread_time / recursive_time)
+            + "x as long as bisecting recursively"
+        );
+    }
+    ok(spread_shorter, "spread_bifractors keys are no longer than bisecting recursively");
+    done_testing();
+}
+static tap::TestSet bench ("util/bifractor/bench", &bifractor_bench);
+
 #endif
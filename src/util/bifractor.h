@@ -7,7 +7,8 @@
  // Bifractors.  The bisecting constructor can take a bias from 0.0 to 1.0.
  // Lower biases will make the result closer to the left side, so that if you
  // expect to bisect in one direction continually, the byte string doesn't get
- // quite as long.  The bias is not guaranteed to be treated exactly.  When
+ // quite as long.  The bias is not guaranteed to be treated exactly; the result
+ // is the shortest byte string reasonably close to the biased point.  When
  // bisecting between two Bifractors, the left one must be strictly lesser than
  // the right one.
  //
@@ -17,27 +18,43 @@
  // to the right with 0x00 bytes.  The empty bytestring is the default value and
  // is invalid for any usage.
 
+#include <cstring>
+#include <memory>
 #include <new>
 #include <ostream>
+#include <vector>
 
 #include "error.h"
 #include "types.h"
 
+struct BifractorArena;
+
 struct Bifractor {
+     // Bifractors up to this long are stored inline, and longer ones on the
+     // heap or in a BifractorArena.  On 64-bit, heap is 16 bytes with its
+     // flag, so this takes no more space than 8 would.  In util/bifractor/bench,
+     // no key gets past 8 bytes in the first 1000 appends, but over half do by
+     // 3000, and most of those fit in 16.
+    static constexpr size_t inline_capacity = 16;
+
     const size_t size;
     union {
-        const uint8* const ptr;
-        const uint8 imm [sizeof(ptr)];
+        struct {
+            const uint8* const ptr;
+             // ptr points into a BifractorArena, so don't delete it
+            const bool borrowed;
+        } heap;
+        const uint8 imm [inline_capacity];
     };
 
     const uint8* bytes () const {
-        if (size <= sizeof(ptr)) return imm;
-        else return ptr;
+        if (size <= inline_capacity) return imm;
+        else return heap.ptr;
     }
 
     String hex () const;
 
-    constexpr Bifractor () : size(0), ptr(nullptr) { }
+    constexpr Bifractor () : size(0), heap{nullptr, false} { }
 
      // Although this takes a float, you should only use it with 0 or 1.
     explicit constexpr Bifractor (float bias) :
@@ -53,29 +70,74 @@ struct Bifractor {
      // unless bytes_size is 0.
     Bifractor (const uint8* bytes_ptr, size_t bytes_size);
 
-    Bifractor (const Bifractor& b) : Bifractor(b.bytes(), b.size) { }
-    Bifractor (Bifractor&& b) : size(b.size), ptr(b.ptr) {
-        const_cast<const uint8*&>(b.ptr) = nullptr;
+     // Copies don't need validating again.  A copy of a Bifractor in an arena
+     // has its own storage.
+    Bifractor (const Bifractor& b) : size(b.size), heap{nullptr, false} {
+        std::memcpy(allocate(), b.bytes(), size);
+    }
+    Bifractor (Bifractor&& b) : size(b.size), heap{nullptr, false} {
+        std::memcpy((void*)&heap, (const void*)&b.heap, sizeof(imm));
         const_cast<size_t&>(b.size) = 0;
     }
     ~Bifractor () {
-        if (size > sizeof(ptr)) {
-            delete[] ptr;
+        if (size > inline_capacity && !heap.borrowed) {
+            delete[] heap.ptr;
         }
     }
     Bifractor& operator = (const Bifractor& b) {
-        this->~Bifractor();
-        new ((void*)this) Bifractor(b);
+        if (this != &b) {
+            this->~Bifractor();
+            new ((void*)this) Bifractor(b);
+        }
         return *this;
     }
     Bifractor& operator = (Bifractor&& b) {
-        this->~Bifractor();
-        new ((void*)this) Bifractor(b);
+        if (this != &b) {
+            this->~Bifractor();
+            new ((void*)this) Bifractor(std::move(b));
+        }
         return *this;
     }
+
+  private:
+    friend BifractorArena;
+    struct Borrow { };
+    Bifractor (const uint8* p, size_t size, Borrow) : size(size), heap{p, true} {
+        AA(size > inline_capacity);
+    }
+     // Sets up storage for size bytes and returns it for filling in
+    uint8* allocate () {
+        if (size <= inline_capacity) return const_cast<uint8*>(imm);
+        auto p = new uint8 [size];
+        const_cast<const uint8*&>(heap.ptr) = p;
+        return p;
+    }
+};
+
+ // Storage for long Bifractors, in big blocks instead of one allocation each.
+ // This is for collections of keys that are cleared or rebuilt all at once;
+ // nothing is freed until the arena is destroyed.  Bifractors from copy point
+ // into the arena if they're too long to be inline, so they can be moved
+ // around but must not outlive it.  Copying them again makes normal
+ // Bifractors.
+struct BifractorArena {
+    Bifractor copy (const Bifractor&);
+     // Total bytes of long Bifractors copied in
+    size_t bytes_used () const { return used; }
+
+  private:
+    static constexpr size_t block_size = 64 * 1024;
+    std::vector<std::unique_ptr<uint8[]>> blocks;
+    uint8* next = nullptr;
+    size_t left = 0;
+    size_t used = 0;
 };
 
-int operator <=> (const Bifractor& a, const Bifractor& b);
+static inline int operator <=> (const Bifractor& a, const Bifractor& b) {
+    int r = std::memcmp(a.bytes(), b.bytes(), a.size < b.size ? a.size : b.size);
+    if (r) return r;
+    return (a.size > b.size) - (a.size < b.size);
+}
 
 static inline bool operator == (const Bifractor& a, const Bifractor& b) {
     if (a.size != b.size) return false;
@@ -87,3 +149,14 @@ static inline std::ostream& operator << (std::ostream& o, const Bifractor& b) {
     return o;
 }
 
+ // Appends n Bifractors between low and high to out, in order and evenly
+ // spaced.  They all use the fewest bytes that leave room for n of them, which
+ // is only about log256(n) bytes past where low and high differ, instead of the
+ // n/8 bytes that bisecting the same end n times would take.
+void spread_bifractors (
+    std::vector<Bifractor>& out, const Bifractor& low, const Bifractor& high, size_t n
+);
+ // Just the i'th one of those, without making the rest
+Bifractor spread_bifractor (
+    const Bifractor& low, const Bifractor& high, size_t i, size_t n
+);
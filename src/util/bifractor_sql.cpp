@@ -0,0 +1,198 @@
+#include "bifractor_sql.h"
+
+#include <optional>
+#include <sqlite3.h>
+
+#include "bifractor.h"
+#include "error.h"
+
+using namespace std;
+
+ // Same rules as Bifractor's constructor, but without throwing
+static bool valid_bytes (const uint8* bytes, size_t size) {
+    if (!size) return false;
+    if (size >= 2 && (bytes[0] == 0xff || bytes[size-1] == 0x00)) return false;
+    return true;
+}
+
+ // Sets an error on ctx and returns nullopt if v isn't a valid Bifractor
+static optional<Bifractor> get_bifractor (sqlite3_context* ctx, sqlite3_value* v) {
+    if (sqlite3_value_type(v) == SQLITE_BLOB) {
+        auto bytes = (const uint8*)sqlite3_value_blob(v);
+        size_t size = sqlite3_value_bytes(v);
+        if (valid_bytes(bytes, size)) return Bifractor(bytes, size);
+    }
+    sqlite3_result_error(ctx, "Argument is not a valid Bifractor", -1);
+    return nullopt;
+}
+
+static bool any_null (int argc, sqlite3_value** argv) {
+    for (int i = 0; i < argc; i++) {
+        if (sqlite3_value_type(argv[i]) == SQLITE_NULL) return true;
+    }
+    return false;
+}
+
+static void result_bifractor (sqlite3_context* ctx, const Bifractor& b) {
+    sqlite3_result_blob(ctx, b.bytes(), int(b.size), SQLITE_TRANSIENT);
+}
+
+static void bifractor_between (sqlite3_context* ctx, int argc, sqlite3_value** argv) {
+    if (any_null(argc, argv)) return sqlite3_result_null(ctx);
+    auto a = get_bifractor(ctx, argv[0]);
+    if (!a) return;
+    auto b = get_bifractor(ctx, argv[1]);
+    if (!b) return;
+    if ((*a <=> *b) >= 0) {
+        return sqlite3_result_error(ctx, "bifractor_between: a must be less than b", -1);
+    }
+     // Bifractor takes a float, so round it the same way
+    float bias = argc > 2 ? float(sqlite3_value_double(argv[2])) : 0.5f;
+    if (!(bias >= 0 && bias <= 1)) {
+        return sqlite3_result_error(ctx, "bifractor_between: bias must be from 0 to 1", -1);
+    }
+    result_bifractor(ctx, Bifractor(*a, *b, bias));
+}
+
+static void bifractor_spread (sqlite3_context* ctx, int argc, sqlite3_value** argv) {
+    if (any_null(argc, argv)) return sqlite3_result_null(ctx);
+    auto a = get_bifractor(ctx, argv[0]);
+    if (!a) return;
+    auto b = get_bifractor(ctx, argv[1]);
+    if (!b) return;
+    if ((*a <=> *b) >= 0) {
+        return sqlite3_result_error(ctx, "bifractor_spread: a must be less than b", -1);
+    }
+    int64 i = sqlite3_value_int64(argv[2]);
+    int64 n = sqlite3_value_int64(argv[3]);
+    if (i < 0 || i >= n) {
+        return sqlite3_result_error(ctx, "bifractor_spread: i must be from 0 to n-1", -1);
+    }
+    result_bifractor(ctx, spread_bifractor(*a, *b, size_t(i), size_t(n)));
+}
+
+static void bifractor_valid (sqlite3_context* ctx, int, sqlite3_value** argv) {
+    sqlite3_value* v = argv[0];
+    switch (sqlite3_value_type(v)) {
+        case SQLITE_NULL: return sqlite3_result_null(ctx);
+        case SQLITE_BLOB: return sqlite3_result_int(ctx, valid_bytes(
+            (const uint8*)sqlite3_value_blob(v), sqlite3_value_bytes(v)
+        ));
+        default: return sqlite3_result_int(ctx, 0);
+    }
+}
+
+void register_bifractor_functions (sqlite3* db) {
+    int flags = SQLITE_UTF8 | SQLITE_DETERMINISTIC;
+    AS(db, sqlite3_create_function(db, "bifractor_between", 2, flags, nullptr, &bifractor_between, nullptr, nullptr));
+    AS(db, sqlite3_create_function(db, "bifractor_between", 3, flags, nullptr, &bifractor_between, nullptr, nullptr));
+    AS(db, sqlite3_create_function(db, "bifractor_spread", 4, flags, nullptr, &bifractor_spread, nullptr, nullptr));
+    AS(db, sqlite3_create_function(db, "bifractor_valid", 1, flags, nullptr, &bifractor_valid, nullptr, nullptr));
+}
+
+#ifndef TAP_DISABLE_TESTS
+#include "../tap/tap.h"
+
+static void bifractor_sql_tests () {
+    using namespace tap;
+    sqlite3* db;
+    AS(db, sqlite3_open(":memory:", &db));
+    register_bifractor_functions(db);
+
+     // Runs a query that returns one value, binding Bifractors and numbers.
+     // Returns the blob, or nullopt for NULL or an error.
+    auto query = [&](const char* sql, auto... params){
+        sqlite3_stmt* st;
+        AS(db, sqlite3_prepare_v2(db, sql, -1, &st, nullptr));
+        int i = 1;
+        ([&](const auto& p){
+            if constexpr (is_same_v<decay_t<decltype(p)>, Bifractor>) {
+                sqlite3_bind_blob(st, i++, p.bytes(), int(p.size), SQLITE_TRANSIENT);
+            }
+            else sqlite3_bind_double(st, i++, double(p));
+        }(params), ...);
+        optional<Bifractor> r;
+        if (sqlite3_step(st) == SQLITE_ROW && sqlite3_column_type(st, 0) == SQLITE_BLOB) {
+            r.emplace((const uint8*)sqlite3_column_blob(st, 0), sqlite3_column_bytes(st, 0));
+        }
+        sqlite3_finalize(st);
+        return r;
+    };
+    auto query_int = [&](const char* sql){
+        sqlite3_stmt* st;
+        AS(db, sqlite3_prepare_v2(db, sql, -1, &st, nullptr));
+        int64 r = -1;
+        int rc = sqlite3_step(st);
+        if (rc == SQLITE_ROW) {
+            r = sqlite3_column_type(st, 0) == SQLITE_NULL ? -2 : sqlite3_column_int64(st, 0);
+        }
+        sqlite3_finalize(st);
+        return r;
+    };
+
+    Bifractor zero {0};
+    Bifractor one {1};
+    auto half = query("SELECT bifractor_between(?, ?)", zero, one);
+    ok(half && *half == Bifractor(zero, one), "bifractor_between(0, 1) matches C++");
+
+     // Wander around randomly and compare every bisection along the way
+    srand(uint(time(0)));
+    bool between_ok = true;
+    Bifractor low = zero;
+    Bifractor high = one;
+    for (int i = 0; i < 2000; i++) {
+        float bias = (rand() % 101) / 100.f;
+        Bifractor expected {low, high, bias};
+        auto got = query("SELECT bifractor_between(?, ?, ?)", low, high, double(bias));
+        if (!got || *got != expected) between_ok = false;
+        if (rand() & 1) low = expected;
+        else high = expected;
+         // Don't let it get too long
+        if (low.size > 40) low = zero;
+        if (high.size > 40) high = one;
+        if (!((low <=> high) < 0)) { low = zero; high = one; }
+    }
+    ok(between_ok, "bifractor_between with random bounds and biases matches C++ byte for byte");
+
+    bool spread_ok = true;
+    for (size_t n : {1, 2, 3, 7, 100, 1000}) {
+        vector<Bifractor> expected;
+        spread_bifractors(expected, zero, one, n);
+        for (size_t i = 0; i < n; i++) {
+            if (spread_bifractor(zero, one, i, n) != expected[i]) spread_ok = false;
+            auto got = query("SELECT bifractor_spread(?, ?, ?, ?)", zero, one, double(i), double(n));
+            if (!got || *got != expected[i]) spread_ok = false;
+        }
+    }
+    ok(spread_ok, "bifractor_spread matches spread_bifractors byte for byte");
+
+    is(query_int(R"(
+WITH RECURSIVE seq (i) AS (SELECT 0 UNION ALL SELECT i + 1 FROM seq WHERE i < 99)
+SELECT COUNT(*) FROM (
+    SELECT bifractor_spread(X'00', X'FF', i, 100) AS p,
+        LAG(bifractor_spread(X'00', X'FF', i, 100)) OVER (ORDER BY i) AS prev
+    FROM seq
+) WHERE prev IS NULL OR prev < p
+    )"), int64(100), "bifractor_spread results are in order in SQL");
+
+    is(query_int("SELECT bifractor_valid(X'00')"), int64(1), "X'00' is valid");
+    is(query_int("SELECT bifractor_valid(X'FF')"), int64(1), "X'FF' is valid");
+    is(query_int("SELECT bifractor_valid(X'8001')"), int64(1), "X'8001' is valid");
+    is(query_int("SELECT bifractor_valid(X'FF01')"), int64(0), "Starting with FF is invalid");
+    is(query_int("SELECT bifractor_valid(X'0100')"), int64(0), "Ending with 00 is invalid");
+    is(query_int("SELECT bifractor_valid(X'')"), int64(0), "Empty is invalid");
+    is(query_int("SELECT bifractor_valid('text')"), int64(0), "Text is invalid");
+    is(query_int("SELECT bifractor_valid(NULL)"), int64(-2), "bifractor_valid(NULL) is NULL");
+
+    is(query_int("SELECT bifractor_between(X'FF', X'00')"), int64(-1), "Bounds in the wrong order are an error");
+    is(query_int("SELECT bifractor_between(X'00', X'FF', 2)"), int64(-1), "Bias out of range is an error");
+    is(query_int("SELECT bifractor_between(X'0100', X'FF')"), int64(-1), "Invalid bounds are an error");
+    is(query_int("SELECT bifractor_spread(X'00', X'FF', 5, 5)"), int64(-1), "i out of range is an error");
+    is(query_int("SELECT bifractor_spread(X'00', NULL, 0, 5)"), int64(-2), "NULL in, NULL out");
+
+    sqlite3_close(db);
+    done_testing();
+}
+static tap::TestSet tests ("util/bifractor_sql", &bifractor_sql_tests);
+
+#endif
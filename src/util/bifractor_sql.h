@@ -0,0 +1,20 @@
+#pragma once
+
+ // SQL functions for making Bifractors inside SQLite, so that bulk operations
+ // can compute positions in one INSERT ... SELECT or UPDATE instead of sending
+ // every row through C++.  They make exactly the same bytes as the C++
+ // functions.
+ //
+ //   bifractor_between(a, b)         Bifractor(a, b)
+ //   bifractor_between(a, b, bias)   Bifractor(a, b, bias)
+ //   bifractor_spread(a, b, i, n)    spread_bifractor(a, b, i, n)
+ //   bifractor_valid(x)              1 if x is a valid Bifractor, 0 if not
+ //
+ // They return NULL if any argument is NULL, and raise an SQL error for invalid
+ // arguments instead of throwing.
+
+struct sqlite3;
+
+ // Registers the above on a connection.  The model's database gets them when
+ // it's opened.
+void register_bifractor_functions (sqlite3*);
@@ -1,7 +1,18 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <exception>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
 #include <optional>
+#include <span>
 #include <tuple>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
@@ -13,38 +24,139 @@
  // Kinda cheating but whatever
 extern sqlite3* db;
 
+ // Number of times any statement has been run, for profiling.
+inline std::atomic<uint64> statements_run = 0;
+
+struct Statement;
+
+ // If set, this is called before a statement is bound or run, and returns the
+ // connection to run it on this time, or nullptr for the one it was prepared
+ // on.  The model uses it to send reads that depend on its writer thread's
+ // queued writes to the writer thread's connection, after they're done.
+inline sqlite3* (* before_statement) (Statement&) = nullptr;
+
+///// Statement registry
+
+ // Every non-transient Statement is registered here, so they can all be
+ // prepared together at startup instead of on first use, and moved to another
+ // connection.  Statements constructed before the database is opened (ones at
+ // namespace scope) aren't prepared until prepare_statements is called, or until
+ // they're first used if that's sooner.
+inline std::vector<Statement*>& all_statements () {
+    static std::vector<Statement*> r;
+    return r;
+}
+inline std::mutex statements_mutex;
+ // Set by prepare_statements
+inline bool statements_started = false;
+ // Number of times a non-transient statement was prepared on first use after
+ // prepare_statements, for profiling.  This should stay near 0.
+inline std::atomic<uint64> late_prepares = 0;
+
 struct Statement {
-    sqlite3_stmt* handle;
+     // Statements can be prepared on a background thread (see
+     // prepare_statements), so this is atomic.  Use get() instead of reading
+     // it directly.
+    std::atomic<sqlite3_stmt*> handle = nullptr;
+    std::string sql;
+    bool transient = false;
     int result_code = 0;
+     // A copy prepared on another connection, which is used instead of
+     // handle from when before_statement returns that connection until the
+     // next reset.
+    sqlite3_stmt* other = nullptr;
+    bool on_other = false;
+     // Whether before_statement has been asked since the last reset
+    bool started = false;
 
-    Statement (sqlite3_stmt* handle) : handle(handle) { }
-    Statement (const char* sql, bool transient = false) {
+    Statement (sqlite3_stmt* handle) : handle(handle), transient(true) { }
+    Statement (const char* sql, bool transient = false) :
+        sql(sql), transient(transient)
+    {
+        if (transient) {
+            get();
+        }
+        else {
+            std::lock_guard lock (statements_mutex);
+            all_statements().push_back(this);
+        }
+    }
+    Statement (const Statement&) = delete;
+
+    sqlite3_stmt* get () {
+        if (on_other) return other;
+        sqlite3_stmt* h = handle.load(std::memory_order_acquire);
+        return h ? h : prepare(true);
+    }
+
+     // Returns the winner if two threads prepare at the same time
+    sqlite3_stmt* prepare (bool on_demand) {
+        sqlite3_stmt* h;
         auto flags = transient ? 0 : SQLITE_PREPARE_PERSISTENT;
-        AS(db, sqlite3_prepare_v3(db, sql, -1, flags, &handle, nullptr));
-    }
-
-    void bind_param (int index, char v) { AS(db, sqlite3_bind_int(handle, index, v)); }
-    void bind_param (int index, signed char v) { AS(db, sqlite3_bind_int(handle, index, v)); }
-    void bind_param (int index, unsigned char v) { AS(db, sqlite3_bind_int(handle, index, v)); }
-    void bind_param (int index, short v) { AS(db, sqlite3_bind_int(handle, index, v)); }
-    void bind_param (int index, unsigned short v) { AS(db, sqlite3_bind_int(handle, index, v)); }
-    void bind_param (int index, int v) { AS(db, sqlite3_bind_int(handle, index, v)); }
-    void bind_param (int index, unsigned int v) { AS(db, sqlite3_bind_int(handle, index, v)); }
-    void bind_param (int index, long v) { AS(db, sqlite3_bind_int64(handle, index, v)); }
-    void bind_param (int index, unsigned long v) { AS(db, sqlite3_bind_int64(handle, index, v)); }
-    void bind_param (int index, long long v) { AS(db, sqlite3_bind_int64(handle, index, v)); }
-    void bind_param (int index, unsigned long long v) { AS(db, sqlite3_bind_int64(handle, index, v)); }
-    void bind_param (int index, float v) { AS(db, sqlite3_bind_double(handle, index, v)); }
-    void bind_param (int index, double v) { AS(db, sqlite3_bind_double(handle, index, v)); }
+        AS(db, sqlite3_prepare_v3(db, sql.c_str(), -1, flags, &h, nullptr));
+        sqlite3_stmt* expected = nullptr;
+        if (!handle.compare_exchange_strong(expected, h)) {
+            sqlite3_finalize(h);
+            return expected;
+        }
+        if (on_demand && !transient && statements_started) late_prepares += 1;
+        return h;
+    }
+
+     // Called before the first bind or step after a reset.  Returns the
+     // handle to bind and run.
+    sqlite3_stmt* start () {
+        if (!started) {
+            sqlite3* conn = before_statement ? before_statement(*this) : nullptr;
+            if (conn && conn != sqlite3_db_handle(get())) {
+                if (other && sqlite3_db_handle(other) != conn) {
+                    sqlite3_finalize(other);
+                    other = nullptr;
+                }
+                if (!other) {
+                    auto flags = transient ? 0 : SQLITE_PREPARE_PERSISTENT;
+                    AS(conn, sqlite3_prepare_v3(
+                        conn, sqlite3_sql(get()), -1, flags, &other, nullptr
+                    ));
+                }
+                on_other = true;
+            }
+            started = true;
+        }
+        return get();
+    }
+
+     // Throws the error for rc from whichever connection the statement is on
+    void check (int rc) {
+        if (rc) AS(sqlite3_db_handle(get()), rc);
+    }
+
+    void bind_param (int index, char v) { check(sqlite3_bind_int(start(), index, v)); }
+    void bind_param (int index, signed char v) { check(sqlite3_bind_int(start(), index, v)); }
+    void bind_param (int index, unsigned char v) { check(sqlite3_bind_int(start(), index, v)); }
+    void bind_param (int index, short v) { check(sqlite3_bind_int(start(), index, v)); }
+    void bind_param (int index, unsigned short v) { check(sqlite3_bind_int(start(), index, v)); }
+    void bind_param (int index, int v) { check(sqlite3_bind_int(start(), index, v)); }
+    void bind_param (int index, unsigned int v) { check(sqlite3_bind_int(start(), index, v)); }
+    void bind_param (int index, long v) { check(sqlite3_bind_int64(start(), index, v)); }
+    void bind_param (int index, unsigned long v) { check(sqlite3_bind_int64(start(), index, v)); }
+    void bind_param (int index, long long v) { check(sqlite3_bind_int64(start(), index, v)); }
+    void bind_param (int index, unsigned long long v) { check(sqlite3_bind_int64(start(), index, v)); }
+    void bind_param (int index, float v) { check(sqlite3_bind_double(start(), index, v)); }
+    void bind_param (int index, double v) { check(sqlite3_bind_double(start(), index, v)); }
     void bind_param (int index, const char* v) {
-        AS(db, sqlite3_bind_text(handle, index, v, -1, SQLITE_TRANSIENT));
+        check(sqlite3_bind_text(start(), index, v, -1, SQLITE_TRANSIENT));
+    }
+     // Strings and blobs aren't copied, so they have to stay alive until the
+     // statement is reset.  The run functions in Ment take care of that.
+    void bind_param (int index, Str v) {
+        check(sqlite3_bind_text(start(), index, v.data(), int(v.size()), SQLITE_STATIC));
     }
     void bind_param (int index, const std::string& v) {
-         // STATIC might be better for most use cases
-        AS(db, sqlite3_bind_text(handle, index, v.c_str(), int(v.size()), SQLITE_TRANSIENT));
+        check(sqlite3_bind_text(start(), index, v.c_str(), int(v.size()), SQLITE_STATIC));
     }
     void bind_param (int index, const Bifractor& v) {
-        AS(db, sqlite3_bind_blob(handle, index, v.bytes(), int(v.size), SQLITE_TRANSIENT));
+        check(sqlite3_bind_blob(start(), index, v.bytes(), int(v.size), SQLITE_STATIC));
     }
     template <class T>
     void bind_param (int index, const std::optional<T>& v) {
@@ -52,56 +164,218 @@ struct Statement {
             bind_param(index, *v);
         }
         else {
-            AS(db, sqlite3_bind_null(handle, index));
+            check(sqlite3_bind_null(start(), index));
         }
     }
 
     void step () {
         AA(result_code != SQLITE_DONE);
-        result_code = sqlite3_step(handle);
-        if (result_code != SQLITE_ROW && result_code != SQLITE_DONE) AS(db, 1);
+        if (!result_code) statements_run += 1;
+        result_code = sqlite3_step(start());
+        if (result_code != SQLITE_ROW && result_code != SQLITE_DONE) check(1);
     }
 
     // Assume int for all other types
     template <class T>
     T read_column (int index) {
-        return T(sqlite3_column_int64(handle, index));
+        return T(sqlite3_column_int64(get(), index));
     }
     template <>
     float read_column<float> (int index) {
-        return float(sqlite3_column_double(handle, index));
+        return float(sqlite3_column_double(get(), index));
     }
     template <>
     double read_column<double> (int index) {
-        return sqlite3_column_double(handle, index);
+        return sqlite3_column_double(get(), index);
     }
     template <>
     std::string read_column<std::string> (int index) {
-        auto p = reinterpret_cast<const char*>(sqlite3_column_text(handle, index));
+        auto p = reinterpret_cast<const char*>(sqlite3_column_text(get(), index));
         return p ? p : "";
+    }
+     // These point into SQLite's copy of the row, so they're only valid until
+     // the next step or reset.
+    template <>
+    Str read_column<Str> (int index) {
+        auto p = reinterpret_cast<const char*>(sqlite3_column_text(get(), index));
+        return p ? Str(p, sqlite3_column_bytes(get(), index)) : Str();
+    }
+    template <>
+    std::span<const uint8> read_column<std::span<const uint8>> (int index) {
+        auto p = reinterpret_cast<const uint8*>(sqlite3_column_blob(get(), index));
+        return std::span<const uint8>(p, sqlite3_column_bytes(get(), index));
     }
     template <>
     Bifractor read_column<Bifractor> (int index) {
-        const void* data = sqlite3_column_blob(handle, index);
-        int size = sqlite3_column_bytes(handle, index);
+        const void* data = sqlite3_column_blob(get(), index);
+        int size = sqlite3_column_bytes(get(), index);
         return Bifractor((const uint8*)data, size);
     }
 
+     // Reads a column into an existing variable.  Strings reuse its buffer.
+    template <class T>
+    void read_field (int index, T& out) {
+        out = read_column<T>(index);
+    }
+    void read_field (int index, std::string& out) {
+        auto p = reinterpret_cast<const char*>(sqlite3_column_text(get(), index));
+        if (p) out.assign(p, sqlite3_column_bytes(get(), index));
+        else out.clear();
+    }
+
     bool done () {
         return result_code == SQLITE_DONE;
     }
 
     void reset () {
-        AS(db, sqlite3_reset(handle));
-        AS(db, sqlite3_clear_bindings(handle));
+        check(sqlite3_reset(get()));
+        check(sqlite3_clear_bindings(get()));
         result_code = 0;
+        started = on_other = false;
+    }
+     // Like reset, but doesn't throw
+    void abandon () {
+        sqlite3_reset(get());
+        sqlite3_clear_bindings(get());
+        result_code = 0;
+        started = on_other = false;
     }
 
     ~Statement () {
-        AS(db, sqlite3_finalize(handle));
+        if (!transient) {
+            std::lock_guard lock (statements_mutex);
+            auto& all = all_statements();
+            all.erase(std::find(all.begin(), all.end(), this));
+        }
+         // This returns the error from the last step if it failed, which was
+         // already thrown, and throwing here could be during unwinding.
+        sqlite3_finalize(handle);
+        sqlite3_finalize(other);
     }
 };
 
+ // Finalizes every registered statement's copy on conn, so it can be closed
+inline void forget_connection (sqlite3* conn) {
+    std::lock_guard lock (statements_mutex);
+    for (auto st : all_statements()) {
+        if (st->other && sqlite3_db_handle(st->other) == conn) {
+            AA(!st->on_other);
+            sqlite3_finalize(st->other);
+            st->other = nullptr;
+        }
+    }
+}
+
+ // Prepares every registered statement that isn't prepared yet.  init_db calls
+ // this after the schema is up to date.  With background, this returns right
+ // away and they're prepared on another thread; anything used before then is
+ // prepared on the spot.
+inline void prepare_statements (bool background = false);
+ // Waits for a background prepare_statements to finish, and throws whatever
+ // it threw.  This has to be called before the database is closed and before
+ // exiting.  init_db, final_checkpoint, rebind_statements, and
+ // prepare_statements call it.
+inline void finish_preparing ();
+
+inline std::thread statement_preparer;
+ // Set by statement_preparer, and only read after it's joined
+inline std::exception_ptr statement_preparer_error;
+
+inline void prepare_statements (bool background) {
+    finish_preparing();
+    statements_started = true;
+    std::vector<Statement*> todo;
+    {
+        std::lock_guard lock (statements_mutex);
+        todo = all_statements();
+    }
+    auto prepare_all = [todo = std::move(todo)]{
+        for (auto st : todo) {
+            if (!st->handle.load(std::memory_order_acquire)) st->prepare(false);
+        }
+    };
+    if (background) {
+        statement_preparer = std::thread([prepare_all = std::move(prepare_all)]{
+            try { prepare_all(); }
+            catch (...) { statement_preparer_error = std::current_exception(); }
+        });
+    }
+    else prepare_all();
+}
+inline void finish_preparing () {
+    if (statement_preparer.joinable()) statement_preparer.join();
+    if (statement_preparer_error) {
+        auto e = statement_preparer_error;
+        statement_preparer_error = nullptr;
+        std::rethrow_exception(e);
+    }
+}
+
+ // Finalizes every registered statement, switches db to new_db, and prepares
+ // them all again on it.  Transient statements aren't moved.  The old
+ // connection is left open.
+inline void rebind_statements (sqlite3* new_db) {
+     // The model's writer thread (which is what sets before_statement) has
+     // statements of its own on the old connection, so it has to be stopped.
+    AA(!before_statement);
+    finish_preparing();
+    {
+        std::lock_guard lock (statements_mutex);
+        for (auto st : all_statements()) {
+            AS(db, sqlite3_finalize(st->handle.exchange(nullptr)));
+            st->result_code = 0;
+        }
+    }
+    db = new_db;
+    prepare_statements();
+}
+
+///// Batches
+
+ // Makes everything run during its lifetime all or nothing.  It's rolled back
+ // if it's destroyed before release is called.  Savepoints nest, so this
+ // works inside a transaction, and outside of one it makes one, so that
+ // everything in it is committed together.
+inline Statement begin_savepoint {"SAVEPOINT batch"};
+inline Statement release_savepoint {"RELEASE batch"};
+inline Statement rollback_savepoint {"ROLLBACK TO batch"};
+struct Savepoint {
+    bool open = true;
+    Savepoint () {
+        begin_savepoint.step();
+        begin_savepoint.reset();
+    }
+    Savepoint (const Savepoint&) = delete;
+    void release () {
+        AA(open);
+        open = false;
+        release_savepoint.step();
+        release_savepoint.reset();
+    }
+    ~Savepoint () {
+        if (!open) return;
+         // Don't throw from here, we're probably already unwinding.
+        try {
+            rollback_savepoint.step();
+            rollback_savepoint.reset();
+            release();
+        }
+        catch (...) { }
+    }
+};
+
+///// Row mapping
+
+ // Specialize this to say which members of T a row's columns go into, in
+ // order, so that rows can be read straight into a T without a tuple in
+ // between:
+ //     template <> struct RowFields<Foo> {
+ //         static constexpr auto list = std::tuple(&Foo::a, &Foo::b);
+ //     };
+ // The statement's Cols have to match the members' types.  See Ment::read_into.
+template <class T>
+struct RowFields;
+
 template <class... Ts>
 struct ResultType {
     using type = std::tuple<Ts...>;
@@ -120,6 +394,12 @@ struct Ment : Statement {
 
     static constexpr std::index_sequence_for<Cols...> cols_indexes = {};
     static constexpr std::index_sequence_for<Params...> params_indexes = {};
+     // Str and span columns point into SQLite's copy of the row, so they can't
+     // be in results that outlive the query.  Those statements can only be run
+     // with run_with or iterate.
+    static constexpr bool borrows_row = (
+        (std::is_same_v<Cols, Str> || std::is_same_v<Cols, std::span<const uint8>>) || ...
+    );
 
     using Statement::Statement; // inherit constructor
 
@@ -142,12 +422,64 @@ struct Ment : Statement {
         return read_with_indexes(cols_indexes);
     }
 
-    // This is probably not efficient for large rows, due to resizing the vector
+    template <size_t first, class T, size_t... indexes>
+    void read_into_with_indexes (T& out, std::index_sequence<indexes...>) {
+        constexpr auto& fields = RowFields<T>::list;
+        static_assert(first + sizeof...(indexes) == sizeof...(Cols),
+            "Number of columns doesn't match RowFields"
+        );
+        static_assert((std::is_same_v<
+            std::remove_reference_t<decltype(out.*std::get<indexes>(fields))>,
+            std::tuple_element_t<first + indexes, std::tuple<Cols...>>
+        > && ...), "Column types don't match RowFields");
+        (read_field(int(first + indexes), out.*std::get<indexes>(fields)), ...);
+    }
+
+     // Reads the current row into out's members, as listed in RowFields<T>,
+     // starting at column first.  out can be a cache slot that's already
+     // allocated, in which case strings reuse their buffers.
+    template <size_t first = 0, class T>
+    void read_into (T& out) {
+        constexpr size_t n = std::tuple_size_v<std::remove_cvref_t<decltype(RowFields<T>::list)>>;
+        read_into_with_indexes<first>(out, std::make_index_sequence<n>());
+    }
+
+    struct iterator {
+        Ment* st;
+        Result operator* () const { return st->read(); }
+        iterator& operator++ () { st->step(); return *this; }
+        bool operator== (std::default_sentinel_t) const { return st->done(); }
+    };
+    struct Rows {
+        Ment* st;
+        explicit Rows (Ment* st) : st(st) { }
+        Rows (const Rows&) = delete;
+         // Not reset(), which can throw
+        ~Rows () { st->abandon(); }
+        iterator begin () { return iterator{st}; }
+        std::default_sentinel_t end () { return {}; }
+    };
+
+     // Steps through the rows as they're used instead of collecting them first:
+     //     for (auto [a, b] : st.iterate(params...)) ...
+     // The statement is reset when the loop ends, even by break or exception.
+     // As with the run functions, params are bound without copying, so they
+     // have to outlive the loop, and Str columns are only valid until the next
+     // row.  Don't run the same statement again inside the loop.
+    Rows iterate (const Params&... params) {
+        bind(params...);
+        step();
+        AA(sqlite3_column_count(get()) == sizeof...(Cols));
+        return Rows(this);
+    }
+
+     // For small results.  Use iterate for big ones.
     std::vector<Result> run (const Params&... params) {
+        static_assert(!borrows_row, "Use run_with or iterate for Str or span columns");
         std::vector<Result> r;
         bind(params...);
         step();
-        AA(sqlite3_column_count(handle) == sizeof...(Cols));
+        AA(sqlite3_column_count(get()) == sizeof...(Cols));
         while (!done()) {
             r.emplace_back(read());
             step();
@@ -164,9 +496,10 @@ struct Ment : Statement {
     }
 
     Result run_single (const Params&... params) {
+        static_assert(!borrows_row, "Use run_with or iterate for Str or span columns");
         bind(params...);
         step();
-        AA(sqlite3_column_count(handle) == sizeof...(Cols));
+        AA(sqlite3_column_count(get()) == sizeof...(Cols));
         Result r = read();
         step();
         AA(done());
@@ -175,13 +508,14 @@ struct Ment : Statement {
     }
 
     std::optional<Result> run_optional (const Params&... params) {
+        static_assert(!borrows_row, "Use run_with or iterate for Str or span columns");
         bind(params...);
         step();
         if (done()) {
             reset();
             return std::nullopt;
         }
-        AA(sqlite3_column_count(handle) == sizeof...(Cols));
+        AA(sqlite3_column_count(get()) == sizeof...(Cols));
         Result r = read();
         step();
         AA(done());
@@ -189,14 +523,56 @@ struct Ment : Statement {
         return std::move(r);
     }
 
+     // Reads the only row into out with read_into.  Returns false if there are
+     // no rows, leaving out alone.
+    template <class T>
+    bool run_into (const Params&... params, T& out) {
+        bind(params...);
+        step();
+        if (done()) {
+            reset();
+            return false;
+        }
+        read_into(out);
+        step();
+        AA(done());
+        reset();
+        return true;
+    }
+
+     // Calls f with each row, for when the row doesn't need to outlive the
+     // query.  Str and span columns can be used, but are only valid during f.
+    template <class F>
+    void run_with (const Params&... params, F&& f) {
+        bind(params...);
+        step();
+        AA(sqlite3_column_count(get()) == sizeof...(Cols));
+        while (!done()) {
+            f(read());
+            step();
+        }
+        reset();
+    }
+
+     // Runs the statement once for each row of params, in one Savepoint.  The
+     // rows are bound without copying, like the other run functions.
+    void run_batch (std::span<const std::tuple<Params...>> rows) {
+        Savepoint sp;
+        for (auto& row : rows) {
+            std::apply([this](const Params&... params){ run_void(params...); }, row);
+        }
+        sp.release();
+    }
+
     Result run_or (const Params&... params, const Result& def) {
+        static_assert(!borrows_row, "Use run_with or iterate for Str or span columns");
         bind(params...);
         step();
         if (done()) {
             reset();
             return def;
         }
-        AA(sqlite3_column_count(handle) == sizeof...(Cols));
+        AA(sqlite3_column_count(get()) == sizeof...(Cols));
         Result r = read();
         step();
         AA(done());
@@ -205,3 +581,65 @@ struct Ment : Statement {
     }
 };
 };
+
+ // Builds the SQL for inserting n_rows rows of n_cols columns at once, like
+ // "INSERT INTO t (a, b) VALUES (?, ?), (?, ?), (?, ?)"
+inline std::string values_sql (Str head, size_t n_rows, size_t n_cols) {
+    std::string r (head);
+    r += " VALUES ";
+    for (size_t i = 0; i < n_rows; i++) {
+        r += i ? ", (" : "(";
+        for (size_t j = 0; j < n_cols; j++) {
+            r += j ? ", ?" : "?";
+        }
+        r += ")";
+    }
+    return r;
+}
+
+ // Inserts many rows with one multi-row INSERT per chunk, instead of one
+ // INSERT per row.  head is the SQL before VALUES.
+ //     MultiInsert<int64, Str> insert {"INSERT INTO t (a, b)"};
+ //     insert.run(rows);
+ // Keep chunk_rows * sizeof...(Params) under SQLite's variable limit, which is
+ // 999 in old versions.
+template <class... Params>
+struct MultiInsert {
+     // A statement for chunk_rows rows, then one for each power of two below
+     // that, largest first.  The rows left after the full chunks go through
+     // the smaller ones, so any count takes only a few INSERTs, and since
+     // these are all registered, prepare_statements prepares them up front.
+    std::vector<std::pair<size_t, std::unique_ptr<Statement>>> chunks;
+
+    MultiInsert (Str head, size_t chunk_rows = 64) {
+        for (size_t n = chunk_rows; n; n = std::bit_floor(n - 1)) {
+            chunks.emplace_back(n, std::make_unique<Statement>(
+                values_sql(head, n, sizeof...(Params)).c_str()
+            ));
+        }
+    }
+
+    static void bind_rows (Statement& st, std::span<const std::tuple<Params...>> rows) {
+        int i = 1;
+        for (auto& row : rows) {
+            std::apply([&](const Params&... params){
+                (st.bind_param(i++, params), ...);
+            }, row);
+        }
+    }
+
+     // Runs in one Savepoint
+    void run (std::span<const std::tuple<Params...>> rows) {
+        Savepoint sp;
+        for (auto& [n, st] : chunks) {
+            while (rows.size() >= n) {
+                bind_rows(*st, rows.first(n));
+                st->step();
+                AA(st->done());
+                st->reset();
+                rows = rows.subspan(n);
+            }
+        }
+        sp.release();
+    }
+};
@@ -212,12 +212,14 @@ void Activity::message_from_webview(json::Value&& message) {
     case x31_hash("new_children"): {
         last_created_new_child = 0;
         const json::Array& children = message[1];
-        Transaction tr;
+        vector<NewTab> new_tabs;
+        new_tabs.reserve(children.size());
         for (auto& child : children) {
             Str url = child[0];
             Str title = child[1];
-            create_tab(tab, TabRelation::LAST_CHILD, url, title);
+            new_tabs.push_back(NewTab{url, title});
         }
+        create_tabs(tab, TabRelation::LAST_CHILD, new_tabs);
         break;
     }
     default: {
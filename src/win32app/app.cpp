@@ -1,6 +1,5 @@
 #include "app.h"
 
-#include <unordered_set>
 #include <windows.h>
 
 #include "../model/data.h"
@@ -23,8 +22,15 @@ App::App (Profile&& p) :
     nursery(*this)
 {
     init_db(profile.db_path());
+    if (settings.writer_thread) start_writer_thread();
+     // Pages that finish loading together commit together
+    set_group_commit_window(0.005);
+}
+App::~App () {
+    flush_relaxed_changes();
+    stop_writer_thread();
+    final_checkpoint();
 }
-App::~App () { }
 
 void App::start (const std::vector<String>& urls) {
     vector<int64> all_windows = get_all_unclosed_windows();
@@ -33,6 +39,7 @@ void App::start (const std::vector<String>& urls) {
              // Create directly instead of going through WindowObserver,
              //  so that focused tabs are not loaded
             barks.emplace(id, new Bark(*this, id));
+            update_focus_pin(id);
         }
     }
     else if (int64 w = get_last_closed_window()) {
@@ -65,6 +72,16 @@ void App::start (const std::vector<String>& urls) {
 }
 
 int App::run () {
+     // Write delayed changes to rapidly-changing fields every now and then,
+     // and checkpoint the WAL if nothing's happening.  See set_relaxed_fields
+     // and idle_checkpoint.
+    UINT_PTR flush_timer = SetTimer(nullptr, 0, 2000,
+        [](HWND, UINT, UINT_PTR, DWORD){
+            flush_relaxed_changes();
+            idle_checkpoint();
+        }
+    );
+    AW(flush_timer);
     MSG msg;
     while (GetMessage(&msg, nullptr, 0, 0)) {
         if (!IsDialogMessage(GetAncestor(msg.hwnd, GA_ROOT), &msg)) {
@@ -72,6 +89,8 @@ int App::run () {
             DispatchMessage(&msg);
         }
     }
+    KillTimer(nullptr, flush_timer);
+    flush_relaxed_changes();
     return (int)msg.wParam;
 }
 
@@ -89,37 +108,11 @@ Activity* App::ensure_activity_for_tab (int64 id) {
     auto iter = activities.find(id);
     if (iter == activities.end()) {
         iter = activities.emplace(id, new Activity(*this, id)).first;
-         // Delete old activities
-         // TODO: configurable values
-        while (activities.size() > 80) {
-            unordered_set<int64> keep_loaded;
-             // Don't unload self!
-            keep_loaded.emplace(id);
-             // Don't unload tabs focused by any windows
-            for (auto w : get_all_unclosed_windows()) {
-                keep_loaded.emplace(get_window_data(w)->focused_tab);
-            }
-             // Keep last n loaded tabs regardless
-            for (auto t : get_last_visited_tabs(20)) {
-                keep_loaded.emplace(t);
-            }
-             // Find last unstarred tab or last starred tab
-            int64 victim_id = 0;
-            TabData* victim_dat = nullptr;
-            for (auto& [id, activity] : activities) {
-                if (keep_loaded.contains(id)) continue;
-                auto dat = get_tab_data(id);
-                 // Not yet visited?  Not quite sure why this would happen.
-                if (dat->visited_at == 0) continue;
-                if (!victim_id
-                    || !dat->starred_at && victim_dat->starred_at
-                    || dat->visited_at < victim_dat->visited_at
-                ) {
-                    victim_id = id;
-                    victim_dat = dat;
-                }
-            }
-            delete_activity(victim_id);
+        auto data = get_tab_data(id);
+        eviction.add(id, data->visited_at, data->starred_at);
+         // Delete old activities, but don't unload self!
+        for (int64 victim : eviction.evict(id)) {
+            delete_activity(victim);
         }
     }
     return iter->second.get();
@@ -127,6 +120,21 @@ Activity* App::ensure_activity_for_tab (int64 id) {
 
 void App::delete_activity (int64 id) {
     activities.erase(id);
+    eviction.remove(id);
+}
+
+void App::update_focus_pin (int64 window) {
+    auto data = get_window_data(window);
+    int64 tab = data->closed_at ? 0 : data->focused_tab;
+    auto iter = focus_pins.find(window);
+    int64 old_tab = iter == focus_pins.end() ? 0 : iter->second;
+    if (tab == old_tab) return;
+    if (old_tab) eviction.unpin(old_tab);
+    if (tab) {
+        eviction.pin(tab);
+        focus_pins[window] = tab;
+    }
+    else focus_pins.erase(iter);
 }
 
 void App::Observer_after_commit (
@@ -138,8 +146,11 @@ void App::Observer_after_commit (
         if (data->closed_at || data->deleted) {
             delete_activity(id);
         }
+        else eviction.update(id, data->visited_at, data->starred_at);
     }
+    vector<Bark*> new_barks;
     for (int64 id : updated_windows) {
+        update_focus_pin(id);
         auto data = get_window_data(id);
         auto iter = barks.find(id);
         if (iter == barks.end()) {
@@ -147,16 +158,33 @@ void App::Observer_after_commit (
                 auto [iter, emplaced] = barks.emplace(id, new Bark(*this, id));
                  // Automatically load focused tab
                 iter->second->claim_activity(ensure_activity_for_tab(data->focused_tab));
+                new_barks.push_back(iter->second.get());
             }
         }
         else if (data->closed_at) {
             barks.erase(id);
         }
     }
-    for (auto& [id, bark] : barks) {
-        bark->update(updated_tabs, updated_windows);
+     // Barks are Observers themselves, and only get the tabs they show.  The
+     // ones just created weren't around when this round started, so pass the
+     // windows on to them here.  They don't show any tabs yet.
+    for (auto bark : new_barks) {
+        bark->Observer_after_commit({}, updated_windows);
     }
     if (barks.empty()) quit();
+
+     // If no other transaction ends the group, end it when the window passes.
+    static UINT_PTR group_commit_timer = 0;
+    if (group_commit_pending() && !group_commit_timer) {
+        group_commit_timer = SetTimer(nullptr, 0, 5,
+            [](HWND, UINT, UINT_PTR, DWORD){
+                KillTimer(nullptr, group_commit_timer);
+                group_commit_timer = 0;
+                flush_group_commit();
+            }
+        );
+        AW(group_commit_timer);
+    }
 }
 
 #ifndef TAP_DISABLE_TESTS
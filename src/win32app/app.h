@@ -4,6 +4,7 @@
 #include <vector>
 
 #include "../model/data.h"
+#include "../model/eviction.h"
 #include "../util/types.h"
 #include "nursery.h"
 #include "profile.h"
@@ -22,6 +23,10 @@ struct App : Observer {
 
     std::unordered_map<int64, std::unique_ptr<Bark>> barks;
     std::unordered_map<int64, std::unique_ptr<Activity>> activities;
+     // Decides which activities to delete when there are too many
+    EvictionPolicy eviction {80, 0, 20};
+     // Tab pinned in eviction for each window, which is its focused tab
+    std::unordered_map<int64, int64> focus_pins;
 
     App (Profile&&);
     ~App ();
@@ -37,6 +42,7 @@ struct App : Observer {
     Activity* activity_for_tab (int64 id);
     Activity* ensure_activity_for_tab (int64 id);
     void delete_activity (int64 id);
+    void update_focus_pin (int64 window);
 
     void Observer_after_commit (
         const std::vector<int64>& updated_tabs,
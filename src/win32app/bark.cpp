@@ -23,7 +23,7 @@ using namespace std;
 namespace win32app {
 
 Bark::Bark (App& app, int64 id) :
-    app(app), id(id), os_window(this)
+    Observer(true), app(app), id(id), os_window(this)
 {
     app.nursery.new_webview([this](ICoreWebView2Controller* wvc, ICoreWebView2* wv, HWND h){
         controller = wvc;
@@ -274,7 +274,7 @@ void Bark::message_from_shell (json::Value&& message) {
          // TODO: initialize expanded tabs in constructor
         vector<int64> known_tabs;
         for (int64 tab = data->focused_tab;; tab = get_tab_data(tab)->parent) {
-            expanded_tabs.emplace(tab);
+            expand(tab);
             known_tabs.emplace_back(tab);
             for (int64 c : get_all_children(tab)) {
                 known_tabs.emplace_back(c);
@@ -393,7 +393,7 @@ void Bark::message_from_shell (json::Value&& message) {
     }
     case x31_hash("expand"): {
         int64 tab = message[1];
-        expanded_tabs.emplace(tab);
+        expand(tab);
         vector<int64> new_known_tabs;
         for (int64 c : get_all_children(tab)) {
             for (int64 g : get_all_children(c)) {
@@ -405,7 +405,7 @@ void Bark::message_from_shell (json::Value&& message) {
     }
     case x31_hash("contract"): {
         int64 tab = message[1];
-        expanded_tabs.erase(tab);
+        contract(tab);
         break;
     }
     case x31_hash("show_in_new_window"): {
@@ -463,7 +463,19 @@ void Bark::focus_tab (int64 tab) {
     }
 }
 
-void Bark::update (
+void Bark::expand (int64 tab) {
+    if (expanded_tabs.emplace(tab).second) {
+        observe_tab(this, tab, 2);
+    }
+}
+
+void Bark::contract (int64 tab) {
+    if (expanded_tabs.erase(tab)) {
+        unobserve_tab(this, tab, 2);
+    }
+}
+
+void Bark::Observer_after_commit (
     const vector<int64>& updated_tabs,
     const vector<int64>& updated_windows
 ) {
@@ -479,18 +491,11 @@ void Bark::send_update (const std::vector<int64>& updated_tabs) {
     bool focused_tab_changed = data->focused_tab != old_focused_tab;
     old_focused_tab = data->focused_tab;
 
+     // These are all known tabs (expanded tabs and their children and
+     // grandchildren), because of observe_tab.
     for (int64 tab : updated_tabs) {
         if (!tab) continue;
         auto t = get_tab_data(tab);
-        int64 grandparent = t->parent ? get_tab_data(t->parent)->parent : 0;
-
-         // Only send tab if it is a known tab (child or grandchild of expanded tab)
-        if (!expanded_tabs.count(tab)
-         && !expanded_tabs.count(t->parent)
-         && !expanded_tabs.count(grandparent)
-        ) {
-            continue;
-        }
 
          // Sending no tab data tells webview to delete tab
         if (t->deleted) {
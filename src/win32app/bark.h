@@ -17,7 +17,7 @@ namespace json { struct Value; }
 namespace win32app {
 struct App;
 
-struct Bark {
+struct Bark : Observer {
     App& app;
     int64 id;
     wil::com_ptr<ICoreWebView2Controller> controller;
@@ -28,7 +28,8 @@ struct Bark {
      //  - Expanded tabs
      //  - Visible tabs, children of expanded tabs
      //  - Known tabs, children of visible tabs, grandchildren of expanded tabs
-     // Here we only need to store expanded tabs.
+     // Here we only need to store expanded tabs.  Each one is registered with
+     // observe_tab, so we only get updates for known tabs.
      // This set will include the root tab, including if it's the pseudo-tab 0
     std::set<int64> expanded_tabs;
 
@@ -61,10 +62,12 @@ struct Bark {
     void message_to_shell (json::Value&& message);
 
      // Observation
-    void update (
+    void expand (int64 tab);
+    void contract (int64 tab);
+    void Observer_after_commit (
         const std::vector<int64>& updated_tabs,
         const std::vector<int64>& updated_windows
-    );
+    ) override;
 
     Bark (App& app, int64 id);
     ~Bark();
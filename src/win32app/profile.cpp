@@ -53,6 +53,10 @@ Settings Profile::load_settings () {
             r.theme = pair.second;
             break;
         }
+        case x31_hash("writer_thread"): {
+            r.writer_thread = pair.second;
+            break;
+        }
         default:
             ERR("Unrecognized setting name: "sv + pair.first);
         }
@@ -7,6 +7,8 @@ namespace win32app {
  // TODO: move to model
 struct Settings {
     String theme;
+     // See start_writer_thread in model/data.h
+    bool writer_thread = false;
 };
 
 struct Profile {